@@ -0,0 +1,43 @@
+#!/bin/bash
+#
+# bench.sh - compare the proxy's connection engines under load
+#
+# usage: ./bench.sh [clients] [requests per client]
+#
+# Starts Tiny as the origin and runs proxybench against the proxy in
+# each engine mode, once with a cached object (every request a hit)
+# and once with unique CGI URLs (every request a miss).
+#
+CLIENTS=${1:-16}
+REQUESTS=${2:-200}
+HOST=localhost
+
+(cd ./tiny && make > /dev/null) || exit 1
+make proxy proxybench > /dev/null || exit 1
+
+tiny_port=$(./free-port.sh)
+(cd ./tiny && exec ./tiny ${tiny_port} > /dev/null 2>&1) &
+tiny_pid=$!
+trap 'kill ${tiny_pid} ${proxy_pid} 2> /dev/null' EXIT
+sleep 1
+
+for mode in threads epoll uring
+do
+    proxy_port=$(./free-port.sh)
+    ./proxy -r 0 -m ${mode} ${proxy_port} > /dev/null 2>&1 &
+    proxy_pid=$!
+    sleep 1
+
+    hit="http://${HOST}:${tiny_port}/home.html"
+    miss="http://${HOST}:${tiny_port}/cgi-bin/adder?%d&1"
+    ./proxybench ${HOST} ${proxy_port} ${hit} 1 1 > /dev/null
+
+    echo "${mode} hit:  $(./proxybench ${HOST} ${proxy_port} ${hit} \
+        ${CLIENTS} ${REQUESTS})"
+    echo "${mode} miss: $(./proxybench ${HOST} ${proxy_port} ${miss} \
+        ${CLIENTS} $((REQUESTS / 4)))"
+
+    kill ${proxy_pid}
+    wait ${proxy_pid} 2> /dev/null
+done
+exit 0
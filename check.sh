@@ -0,0 +1,112 @@
+#!/bin/bash
+#
+# check.sh - regression checks for request framing
+#
+# usage: ./check.sh
+#
+# Starts Tiny as the origin and, against the proxy in each engine mode,
+# sends a kept-alive GET whose body holds a second request. The proxy
+# must answer once, with a 400, and close; a GET with an empty body
+# must still be served. A chunked response that also carries a wrong
+# Content-Length must lose it wherever the threads engine decodes the
+# chunks: for an HTTP/1.0 client and in the cached copy. A client that
+# keeps reading, but too slowly to finish within the total deadline,
+# must be cut off.
+#
+HOST=localhost
+
+(cd ./tiny && make > /dev/null) || exit 1
+make proxy > /dev/null || exit 1
+
+tiny_port=$(./free-port.sh)
+(cd ./tiny && exec ./tiny ${tiny_port} > /dev/null 2>&1) &
+tiny_pid=$!
+trap 'kill ${tiny_pid} ${proxy_pid} 2> /dev/null' EXIT
+sleep 1
+
+# Send $2 to the proxy on port $1; print the status lines of the replies
+function exchange {
+    exec 3<> /dev/tcp/${HOST}/$1 || return 1
+    env printf "$2" >&3 # One write, so the reply cannot cut it short
+    timeout 5 cat <&3 | tr -d '\r' | grep "^HTTP/"
+    exec 3<&-
+}
+
+# Send $2 to the proxy on port $1; print the whole reply
+function fetch {
+    exec 3<> /dev/tcp/${HOST}/$1 || return 1
+    env printf "$2" >&3
+    timeout 5 cat <&3 | tr -d '\r'
+    exec 3<&-
+}
+
+smuggled="GET http://${HOST}:${tiny_port}/godzilla.gif HTTP/1.1\r\nHost: ${HOST}\r\n\r\n"
+length=$(printf "${smuggled}" | wc -c)
+total=2     # Seconds the proxy gives each transaction
+idle=5      # Longer, so only the total deadline can cut a slow reader
+bigsize=16777216
+failed=0
+for mode in ${MODES:-threads epoll uring}
+do
+    proxy_port=$(./free-port.sh)
+    ./proxy -r 0 -m ${mode} -T 1:1:${idle}:${total} ${proxy_port} \
+        > /dev/null 2>&1 &
+    proxy_pid=$!
+    sleep 1
+
+    for te in "Content-Length: ${length}" "Transfer-Encoding: chunked"
+    do
+        got=$(exchange ${proxy_port} \
+            "GET http://${HOST}:${tiny_port}/home.html HTTP/1.1\r\nHost: ${HOST}\r\n${te}\r\n\r\n${smuggled}")
+        if [ "${got}" != "HTTP/1.0 400 Bad Request" ]; then
+            echo "${mode}: GET with ${te%%:*} got: ${got}"
+            failed=1
+        fi
+    done
+    got=$(exchange ${proxy_port} \
+        "GET http://${HOST}:${tiny_port}/home.html HTTP/1.0\r\nContent-Length: 0\r\n\r\n")
+    if [ "${got}" != "HTTP/1.0 200 OK" ]; then
+        echo "${mode}: GET with an empty body got: ${got}"
+        failed=1
+    fi
+
+    # The event engines relay the end server's head as it is
+    if [ ${mode} = threads ]; then
+        chunked="http://${HOST}:${tiny_port}/cgi-bin/chunked"
+        got=$(fetch ${proxy_port} "GET ${chunked} HTTP/1.0\r\n\r\n" |
+            grep -i "^Content-Length")
+        if [ -n "${got}" ]; then
+            echo "${mode}: dechunked for HTTP/1.0 with: ${got}"
+            failed=1
+        fi
+        # Both from the cache, the first kept alive
+        got=$(fetch ${proxy_port} \
+            "GET ${chunked} HTTP/1.1\r\nHost: ${HOST}\r\n\r\nGET ${chunked} HTTP/1.1\r\nHost: ${HOST}\r\nConnection: close\r\n\r\n" |
+            grep -i "^Content-Length" | tr '\n' ' ')
+        if [ "${got}" != "Content-Length: 5 Content-Length: 5 " ]; then
+            echo "${mode}: cached chunked response with: ${got}"
+            failed=1
+        fi
+    fi
+
+    # 640 KB/s for twice the total deadline, then as fast as it comes
+    exec 3<> /dev/tcp/${HOST}/${proxy_port}
+    env printf "GET http://${HOST}:${tiny_port}/cgi-bin/bytes?${bigsize} HTTP/1.0\r\n\r\n" >&3
+    got=0
+    for i in $(seq $((total * 20)))
+    do
+        got=$((got + $(dd bs=65536 count=1 status=none <&3 | wc -c)))
+        sleep 0.1
+    done
+    got=$((got + $(timeout 5 cat <&3 | wc -c)))
+    exec 3<&-
+    if [ ${got} -ge ${bigsize} ]; then
+        echo "${mode}: slow reader got all ${got} bytes past the deadline"
+        failed=1
+    fi
+
+    kill ${proxy_pid}
+    wait ${proxy_pid} 2> /dev/null
+done
+[ ${failed} = 0 ] && echo "request framing: ok"
+exit ${failed}
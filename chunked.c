@@ -0,0 +1,128 @@
+/*
+ * chunked.c - streaming decoder for the chunked transfer coding
+ *
+ * The decoder takes a chunked body in pieces of any size, as they come
+ * off the socket, and keeps only its position in the framing between
+ * calls. Chunk extensions and trailer fields are consumed and dropped.
+ * Decoded data is compacted in place at the front of each piece, so
+ * the caller needs no second buffer.
+ */
+#include "csapp.h"
+#include "chunked.h"
+
+#define CK_MAX_DIGITS 15 /* Keeps chunk sizes within a long */
+
+void chunked_init(chunked_t *d)
+{
+    d->state = CK_SIZE;
+    d->left = 0;
+    d->digits = 0;
+    d->sized = 0;
+}
+
+static int hexval(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+/*
+ * chunked_decode - decode the n bytes at buf, writing the chunk data
+ *     they hold to the front of buf. Returns the number of data bytes
+ *     and sets *used to the bytes consumed, which is less than n only
+ *     if the body ended (CK_DONE) or proved malformed (CK_ERROR) before
+ *     the end of buf.
+ */
+size_t chunked_decode(chunked_t *d, char *buf, size_t n, size_t *used)
+{
+    size_t in = 0, out = 0;
+
+    while (in < n && d->state != CK_DONE && d->state != CK_ERROR)
+    {
+        char c = buf[in];
+
+        switch (d->state)
+        {
+        case CK_SIZE:
+            if (hexval(c) >= 0)
+            {
+                /* Leading zeros do not count towards the limit */
+                if (d->digits == CK_MAX_DIGITS)
+                {
+                    d->state = CK_ERROR;
+                    break;
+                }
+                d->left = d->left * 16 + hexval(c);
+                d->digits += d->left > 0;
+                d->sized = 1;
+                in++;
+            }
+            else if (d->sized &&
+                     (c == ';' || c == ' ' || c == '\t' || c == '\r' ||
+                      c == '\n'))
+                d->state = CK_EXT;
+            else
+                d->state = CK_ERROR;
+            break;
+
+        case CK_EXT:
+            /* Skip extensions; the size takes effect at the LF */
+            in++;
+            if (c == '\n')
+            {
+                d->digits = d->sized = 0;
+                d->state = d->left > 0 ? CK_DATA : CK_TRAILER;
+            }
+            break;
+
+        case CK_DATA:
+        {
+            size_t k = n - in < (size_t)d->left ? n - in : (size_t)d->left;
+
+            memmove(buf + out, buf + in, k);
+            in += k;
+            out += k;
+            d->left -= k;
+            if (d->left == 0)
+                d->state = CK_DATA_CR;
+            break;
+        }
+
+        case CK_DATA_CR:
+            /* Tolerate a bare LF after chunk data */
+            in++;
+            d->state = c == '\r' ? CK_DATA_LF : c == '\n' ? CK_SIZE : CK_ERROR;
+            break;
+
+        case CK_DATA_LF:
+            in++;
+            d->state = c == '\n' ? CK_SIZE : CK_ERROR;
+            break;
+
+        case CK_TRAILER:
+            in++;
+            d->state = c == '\r' ? CK_END_LF
+                       : c == '\n' ? CK_DONE
+                                   : CK_TRAILER_LINE;
+            break;
+
+        case CK_TRAILER_LINE:
+            in++;
+            if (c == '\n')
+                d->state = CK_TRAILER;
+            break;
+
+        case CK_END_LF:
+            in++;
+            d->state = c == '\n' ? CK_DONE : CK_ERROR;
+            break;
+        }
+    }
+    *used = in;
+    return out;
+}
@@ -0,0 +1,27 @@
+/*
+ * chunked.h - streaming decoder for the chunked transfer coding
+ */
+
+/* Decoder states */
+#define CK_SIZE 0      /* In a chunk-size line's hex digits */
+#define CK_EXT 1       /* In the rest of a chunk-size line */
+#define CK_DATA 2      /* In chunk data */
+#define CK_DATA_CR 3   /* Expecting the CRLF after chunk data */
+#define CK_DATA_LF 4
+#define CK_TRAILER 5   /* At the start of a trailer line */
+#define CK_TRAILER_LINE 6 /* In a trailer line */
+#define CK_END_LF 7    /* Expecting the LF of the final blank line */
+#define CK_DONE 8      /* Consumed the whole body */
+#define CK_ERROR 9     /* Malformed */
+
+typedef struct
+{
+    int state;
+    long left;   /* Chunk data bytes still to come (CK_DATA), or the size
+                    being parsed (CK_SIZE) */
+    int digits;  /* Significant hex digits in the current chunk-size */
+    int sized;   /* ... and whether it has any digit at all */
+} chunked_t;
+
+void chunked_init(chunked_t *d);
+size_t chunked_decode(chunked_t *d, char *buf, size_t n, size_t *used);
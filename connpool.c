@@ -0,0 +1,230 @@
+/*
+ * connpool.c - per-origin pool of idle persistent end server connections
+ *
+ * After a response that leaves its connection reusable, the fetcher
+ * parks the socket here under its origin; the next miss for that origin
+ * takes it back instead of paying for a lookup, a handshake and a
+ * teardown. Idle connections are kept newest first, so the warmest is
+ * reused and the oldest are the ones a sweeper thread closes once they
+ * have been idle for idle_us. A checkout peeks at each candidate and
+ * discards any the end server has closed or written to in the meantime.
+ */
+#include "csapp.h"
+#include "connpool.h"
+
+#define CP_SWEEP_US 1000000 /* Interval between idle sweeps */
+
+static long cp_now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+/* FNV-1a hash of key */
+static unsigned cp_hash(const char *key)
+{
+    unsigned h = 2166136261u;
+
+    for (; *key; key++)
+        h = (h ^ (unsigned char)*key) * 16777619u;
+    return h % CP_BUCKETS;
+}
+
+/* Find the origin for key, creating it if create is set; pool is locked */
+static cp_origin_t *cp_origin(connpool_t *cp, const char *key, int create)
+{
+    cp_origin_t *o;
+    unsigned h = cp_hash(key);
+
+    for (o = cp->buckets[h]; o; o = o->next)
+        if (!strcmp(o->key, key))
+            return o;
+    if (!create)
+        return NULL;
+    o = Calloc(1, sizeof(cp_origin_t));
+    strcpy(o->key, key);
+    o->next = cp->buckets[h];
+    cp->buckets[h] = o;
+    return o;
+}
+
+/* Forget an origin with nothing parked; pool is locked */
+static void cp_origin_free(connpool_t *cp, cp_origin_t *o)
+{
+    cp_origin_t **pp = &cp->buckets[cp_hash(o->key)];
+
+    while (*pp != o)
+        pp = &(*pp)->next;
+    *pp = o->next;
+    Free(o);
+}
+
+/*
+ * An idle connection is usable if reading it would block: end of file
+ * means the end server closed it, and data means it sent something no
+ * request asked for.
+ */
+static int cp_healthy(int fd)
+{
+    char c;
+
+    return recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0 &&
+           (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+static void *cp_sweeper(void *vargp)
+{
+    connpool_t *cp = vargp;
+
+    Pthread_detach(pthread_self());
+    while (1)
+    {
+        long cutoff;
+
+        usleep(CP_SWEEP_US);
+        cutoff = cp_now_us() - cp->idle_us;
+
+        P(&cp->mutex);
+        for (int i = 0; i < CP_BUCKETS; i++)
+        {
+            cp_origin_t *o = cp->buckets[i], *onext;
+
+            for (; o; o = onext)
+            {
+                cp_conn_t **pp = &o->idle;
+
+                onext = o->next;
+                /* Newest first, so everything past the first stale one goes */
+                while (*pp && (*pp)->since_us > cutoff)
+                    pp = &(*pp)->next;
+                while (*pp)
+                {
+                    cp_conn_t *c = *pp;
+
+                    *pp = c->next;
+                    close(c->fd);
+                    Free(c);
+                    o->nidle--;
+                    cp->nidle--;
+                    cp->evicted++;
+                }
+                if (!o->idle)
+                    cp_origin_free(cp, o);
+            }
+        }
+        V(&cp->mutex);
+    }
+    return NULL;
+}
+
+/*
+ * connpool_init - create an empty pool keeping at most per_origin idle
+ *     connections to each origin and max_idle in all, each for at most
+ *     idle_us, and start its sweeper
+ */
+void connpool_init(connpool_t *cp, int per_origin, int max_idle,
+                   long idle_us)
+{
+    pthread_t tid;
+
+    memset(cp, 0, sizeof(*cp));
+    cp->per_origin = per_origin;
+    cp->max_idle = max_idle;
+    cp->idle_us = idle_us;
+    Sem_init(&cp->mutex, 0, 1);
+    Pthread_create(&tid, NULL, cp_sweeper, cp);
+}
+
+/*
+ * connpool_get - take a live idle connection to host:port out of the
+ *     pool. Returns its descriptor, or -1 if there is none.
+ */
+int connpool_get(connpool_t *cp, const char *host, const char *port)
+{
+    char key[CP_KEYLEN];
+    cp_origin_t *o;
+    int fd = -1;
+
+    if (snprintf(key, sizeof(key), "%s:%s", host, port) >= CP_KEYLEN)
+        return -1; /* Too long to key without ambiguity, never pooled */
+    P(&cp->mutex);
+    if ((o = cp_origin(cp, key, 0)))
+    {
+        while (fd < 0 && o->idle)
+        {
+            cp_conn_t *c = o->idle;
+
+            o->idle = c->next;
+            o->nidle--;
+            cp->nidle--;
+            if (cp_healthy(c->fd))
+            {
+                fd = c->fd;
+                cp->reused++;
+            }
+            else
+            {
+                close(c->fd);
+                cp->stale++;
+            }
+            Free(c);
+        }
+        if (!o->idle)
+            cp_origin_free(cp, o);
+    }
+    V(&cp->mutex);
+    return fd;
+}
+
+/*
+ * connpool_put - park fd, a connection to host:port ready for another
+ *     request, or close it if the pool is full
+ */
+void connpool_put(connpool_t *cp, const char *host, const char *port, int fd)
+{
+    char key[CP_KEYLEN];
+    cp_origin_t *o;
+    cp_conn_t *c;
+
+    if (snprintf(key, sizeof(key), "%s:%s", host, port) >= CP_KEYLEN)
+    {
+        close(fd);
+        return;
+    }
+    P(&cp->mutex);
+    if (cp->nidle >= cp->max_idle ||
+        ((o = cp_origin(cp, key, 1)) && o->nidle >= cp->per_origin))
+    {
+        cp->refused++;
+        V(&cp->mutex);
+        close(fd);
+        return;
+    }
+    c = Malloc(sizeof(cp_conn_t));
+    c->fd = fd;
+    c->since_us = cp_now_us();
+    c->next = o->idle;
+    o->idle = c;
+    o->nidle++;
+    cp->nidle++;
+    cp->parked++;
+    V(&cp->mutex);
+}
+
+/* Format a one-line summary of the pool into buf - returns its length */
+int connpool_report(connpool_t *cp, char *buf, size_t bufsz)
+{
+    int n;
+
+    P(&cp->mutex);
+    n = snprintf(buf, bufsz,
+                 "upstream pool: %d idle (max %d, %d per origin), "
+                 "%ld reused, %ld stale, %ld parked, %ld refused, "
+                 "%ld evicted\n",
+                 cp->nidle, cp->max_idle, cp->per_origin, cp->reused,
+                 cp->stale, cp->parked, cp->refused, cp->evicted);
+    V(&cp->mutex);
+    return n < (int)bufsz ? n : (int)bufsz - 1;
+}
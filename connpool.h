@@ -0,0 +1,41 @@
+/*
+ * connpool.h - per-origin pool of idle persistent end server connections
+ */
+#define CP_BUCKETS 256 /* Hash buckets for origins */
+#define CP_KEYLEN 320  /* Room for "host:port" */
+
+/* An idle connection, parked until the next request to its origin */
+typedef struct cp_conn
+{
+    struct cp_conn *next; /* Next (older) idle connection to the origin */
+    int fd;
+    long since_us;        /* When it was parked */
+} cp_conn_t;
+
+/* The idle connections to one origin, newest first */
+typedef struct cp_origin
+{
+    struct cp_origin *next; /* Next origin in the hash bucket */
+    char key[CP_KEYLEN];    /* "host:port" */
+    cp_conn_t *idle;
+    int nidle;
+} cp_origin_t;
+
+typedef struct
+{
+    cp_origin_t *buckets[CP_BUCKETS];
+    int per_origin;          /* Most idle connections kept per origin */
+    int max_idle;            /* Most idle connections kept in all */
+    int nidle;               /* Idle connections parked now */
+    long idle_us;            /* Idle connections are closed after this */
+    long reused, stale;      /* Checkouts served, dead ones discarded */
+    long parked, refused;    /* Check-ins kept, turned away when full */
+    long evicted;            /* Closed for sitting idle too long */
+    sem_t mutex;             /* Protects everything above */
+} connpool_t;
+
+void connpool_init(connpool_t *cp, int per_origin, int max_idle,
+                   long idle_us);
+int connpool_get(connpool_t *cp, const char *host, const char *port);
+void connpool_put(connpool_t *cp, const char *host, const char *port, int fd);
+int connpool_report(connpool_t *cp, char *buf, size_t bufsz);
@@ -20,6 +20,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
 #include <errno.h>
 #include <math.h>
 #include <pthread.h>
@@ -51,6 +52,14 @@ typedef struct {
 } rio_t;
 /* $end rio_t */
 
+/* Output gathered from several buffers, sent by one writev (Rio) */
+#define RIO_IOVMAX 8
+typedef struct {
+    int rio_iovcnt;                   /* Pieces gathered */
+    size_t rio_len;                   /* Bytes in all the pieces */
+    struct iovec rio_iov[RIO_IOVMAX]; /* The pieces, in order */
+} rio_iov_t;
+
 /* External variables */
 extern int h_errno;    /* Defined by BIND for DNS errors */ 
 extern char **environ; /* Defined by libc */
@@ -59,6 +68,7 @@ extern char **environ; /* Defined by libc */
 #define	MAXLINE	 8192  /* Max text line length */
 #define MAXBUF   8192  /* Max I/O buffer size */
 #define LISTENQ  1024  /* Second argument to listen() */
+#define CONNECT_STAGGER_MS 250 /* Happy Eyeballs head start per address */
 
 /* Our own error-handling functions */
 void unix_error(char *msg);
@@ -178,21 +188,30 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n);
 void rio_readinitb(rio_t *rp, int fd); 
 ssize_t	rio_readnb(rio_t *rp, void *usrbuf, size_t n);
 ssize_t	rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
+ssize_t	rio_readlinep(rio_t *rp, char **linep);
+ssize_t	rio_fillb(rio_t *rp);
+void rio_iovinit(rio_iov_t *vp);
+int rio_iovadd(rio_iov_t *vp, void *buf, size_t n);
+ssize_t rio_writev(int fd, rio_iov_t *vp);
 
 /* Wrappers for Rio package */
 ssize_t Rio_readn(int fd, void *usrbuf, size_t n);
 void Rio_writen(int fd, void *usrbuf, size_t n);
+void Rio_writev(int fd, rio_iov_t *vp);
 void Rio_readinitb(rio_t *rp, int fd); 
 ssize_t Rio_readnb(rio_t *rp, void *usrbuf, size_t n);
 ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
 
 /* Reentrant protocol-independent client/server helpers */
 int open_clientfd(char *hostname, char *port);
+int open_clientfd_timed(char *hostname, char *port, int timeout_ms);
 int open_listenfd(char *port);
+int open_listenfd_reuseport(char *port);
 
 /* Wrappers for reentrant protocol-independent client/server helpers */
 int Open_clientfd(char *hostname, char *port);
 int Open_listenfd(char *port);
+int Open_listenfd_reuseport(char *port);
 
 
 #endif /* __CSAPP_H__ */
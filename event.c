@@ -0,0 +1,692 @@
+/*
+ * event.c - edge-triggered epoll connection engine
+ *
+ * A few reactor threads multiplex every client and upstream socket.
+ * Each connection is a small state machine that only ever performs
+ * non-blocking reads and writes; the operations that can block - the
+ * cache lookup and name lookup for a request, and cache insertion - run
+ * on a separate offload pool and report back through the owning
+ * reactor's eventfd. Deadlines live on a timer wheel per reactor; an
+ * expired one shuts the socket down, which surfaces here as an ordinary
+ * EOF or error event.
+ *
+ * Events carry a pointer to what they are about rather than a
+ * descriptor, whose number another reactor may reuse as soon as it is
+ * closed. A connection closed while handling a batch of events is only
+ * freed after the batch, so later events in it find it marked closed.
+ */
+#include "csapp.h"
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/tcp.h>
+#include "http.h"
+#include "hotkey.h"
+#include "proxy.h"
+#include "offload.h"
+#include "twheel.h"
+#include "event.h"
+
+#define EV_MAXEVENTS 128
+#define EV_BUFSIZE 16384     /* Relay buffer between upstream and client */
+#define EV_OFFLOAD_THREADS 4 /* Threads running blocking work */
+
+/* Connection states */
+#define CS_REQUEST 0 /* Reading the client's request */
+#define CS_RESOLVE 1 /* Cache and name lookup queued on the offload pool */
+#define CS_CONNECT 2 /* Non-blocking connect to the end server */
+#define CS_RELAY 3   /* Sending the request and relaying the response */
+#define CS_FLUSH 4   /* Writing the remaining output, then closing */
+
+/* What an epoll event is about */
+#define EV_LISTEN 0 /* The listening socket */
+#define EV_WAKE 1   /* The reactor's eventfd */
+#define EV_CLIENT 2 /* A connection's client socket */
+#define EV_SERVER 3 /* A connection's end server socket */
+
+typedef struct
+{
+    int kind;          /* EV_* */
+    struct conn *conn; /* For EV_CLIENT and EV_SERVER */
+} evsrc_t;
+
+typedef struct reactor
+{
+    int epfd;           /* epoll instance */
+    int efd;            /* eventfd signalled when lookups complete */
+    int listenfd;       /* Shared listening socket */
+    evsrc_t lsrc, wsrc; /* Event sources of listenfd and efd */
+    struct conn *done;  /* Connections whose lookup completed */
+    sem_t mutex;        /* Protects done */
+    struct conn *dead;  /* Connections closed in this batch of events */
+    twheel_t wheel;     /* Deadlines of this reactor's connections */
+} reactor_t;
+
+typedef struct conn
+{
+    task_t task;        /* Request lookups (must be first) */
+    struct conn *next;  /* Link in the reactor's done or dead list */
+    reactor_t *r;       /* Owning reactor */
+    int fd;             /* Client socket */
+    int sfd;            /* End server socket, or -1 */
+    evsrc_t csrc, ssrc; /* Event sources of fd and sfd */
+    int state;
+    int closed;         /* Closed; freed after the current batch */
+    twtimer_t deadline; /* Deadline of the current phase */
+    long start_us;      /* When the connection was accepted */
+
+    char in[MAXBUF];    /* Client request bytes */
+    size_t inlen;
+    http_req_t hreq;    /* Their parse, resumed as more arrive */
+
+    char *out;          /* Bytes waiting to be sent to the client */
+    size_t outcap, outlen, outoff;
+
+    char req[MAXBUF];   /* Request for the end server */
+    size_t reqlen, reqoff;
+
+    char uri[MAXLINE], host[MAXLINE], port[MAXLINE];
+    struct addrinfo *ai;  /* Lookup result */
+    struct addrinfo *aip; /* Address being tried */
+    int gai_rc;
+    int action;         /* prepare_request's outcome: REQ_* */
+    char *resp;         /* The response for REQ_RESPOND */
+    size_t resplen;
+
+    objbuf_t obj;       /* Response kept for the cache */
+    long start;         /* now_us() when the fetch began */
+    long relayed;       /* Bytes relayed to the client */
+    int eof;            /* End server finished sending */
+} conn_t;
+
+static void relay(conn_t *c);
+
+static void set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/* Add fd to the reactor's interest list, edge-triggered */
+static int ev_add(reactor_t *r, int fd, evsrc_t *src)
+{
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = src;
+    return epoll_ctl(r->epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+/*
+ * Release everything a connection owns. The conn_t itself goes on the
+ * reactor's dead list, as events for it may remain in the batch being
+ * handled.
+ */
+static void conn_close(conn_t *c)
+{
+    twheel_cancel(&c->r->wheel, &c->deadline);
+    if (c->fd >= 0)
+        close(c->fd);
+    if (c->sfd >= 0)
+        close(c->sfd);
+    if (c->ai)
+        freeaddrinfo(c->ai);
+    free(c->out);
+    free(c->resp);
+    objbuf_free(&c->obj);
+    c->closed = 1;
+    c->next = c->r->dead;
+    c->r->dead = c;
+}
+
+/****************
+ * Offload tasks
+ ****************/
+
+/*
+ * Offload task: answer the request from the cache, or build the request
+ * for the end server and resolve it, then wake the owning reactor. The
+ * cache's locks may be held by a writer, so this stays off the reactor.
+ */
+static void request_task(task_t *tp)
+{
+    conn_t *c = (conn_t *)tp;
+    reactor_t *r = c->r;
+    struct addrinfo hints;
+    uint64_t one = 1;
+
+    c->action = prepare_request(c->in, &c->hreq, c->uri, c->host, c->port,
+                                c->req, sizeof(c->req), &c->resp,
+                                &c->resplen);
+    if (c->action == REQ_FETCH)
+    {
+        c->start = now_us();
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+        c->gai_rc = getaddrinfo(c->host, c->port, &hints, &c->ai);
+    }
+
+    P(&r->mutex);
+    c->next = r->done;
+    r->done = c;
+    V(&r->mutex);
+    if (write(r->efd, &one, sizeof(one)) < 0)
+        perror("request_task: eventfd write");
+}
+
+/****************
+ * Client output
+ ****************/
+
+/*
+ * Write pending output to the client. Returns 1 once the buffer is
+ * empty, 0 if the socket would block, and -1 on error.
+ */
+static int out_flush(conn_t *c)
+{
+    while (c->outoff < c->outlen)
+    {
+        ssize_t n = send(c->fd, c->out + c->outoff, c->outlen - c->outoff,
+                         MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        c->outoff += n;
+    }
+    c->outoff = c->outlen = 0;
+    return 1;
+}
+
+/* Send what is queued, then close the connection */
+static void finish(conn_t *c)
+{
+    if (c->state != CS_FLUSH)
+    {
+        /*
+         * A client that stops reading is dropped after the idle time,
+         * and one that reads slowly once the request is out of time
+         */
+        c->state = CS_FLUSH;
+        twheel_arm(&c->r->wheel, &c->deadline, c->fd, SHUT_RDWR,
+                   deadline_budget(c->start_us, timeouts.idle_us));
+    }
+    if (out_flush(c) != 0)
+        conn_close(c);
+}
+
+/* Queue an error response and close once it is sent */
+static void send_error(conn_t *c, const char *errnum, const char *shortmsg,
+                       const char *longmsg)
+{
+    free(c->out);
+    c->out = error_response(errnum, shortmsg, longmsg, &c->outlen);
+    c->outcap = c->outlen;
+    c->outoff = 0;
+    finish(c);
+}
+
+/*****************
+ * Request stage
+ *****************/
+
+/* Act on a complete request held in c->in: its lookups may block */
+static void handle_request(conn_t *c)
+{
+    twheel_cancel(&c->r->wheel, &c->deadline);
+    c->state = CS_RESOLVE;
+    c->task.run = request_task;
+    offload_submit(&c->task);
+}
+
+/* Read request bytes until the header block is complete */
+static void read_request(conn_t *c)
+{
+    while (1)
+    {
+        ssize_t n = read(c->fd, c->in + c->inlen, sizeof(c->in) - c->inlen);
+        if (n > 0)
+        {
+            int rc;
+
+            c->inlen += n;
+            rc = http_parse(&c->hreq, c->in, c->inlen);
+            if (rc == HTTP_DONE)
+            {
+                handle_request(c);
+                return;
+            }
+            if (rc == HTTP_BAD)
+            {
+                send_error(c, "400", "Bad Request",
+                           "Proxy could not parse the request");
+                return;
+            }
+            if (rc == HTTP_TOOBIG || c->inlen == sizeof(c->in))
+            {
+                send_error(c, "431", "Request Header Fields Too Large",
+                           "Request header too large");
+                return;
+            }
+        }
+        else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        else if (n < 0 && errno == EINTR)
+            continue;
+        else if (c->deadline.expired)
+        {
+            send_error(c, "408", "Request Timeout",
+                       "Proxy timed out waiting for the request");
+            return;
+        }
+        else
+        {
+            /* EOF or error before a complete request */
+            conn_close(c);
+            return;
+        }
+    }
+}
+
+/******************
+ * Upstream stage
+ ******************/
+
+/* Start a non-blocking connect to the next candidate address */
+static void start_connect(conn_t *c)
+{
+    for (; c->aip; c->aip = c->aip->ai_next)
+    {
+        struct addrinfo *p = c->aip;
+
+        if ((c->sfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0)
+            continue;
+        set_nonblocking(c->sfd);
+        if ((connect(c->sfd, p->ai_addr, p->ai_addrlen) == 0 ||
+             errno == EINPROGRESS) &&
+            ev_add(c->r, c->sfd, &c->ssrc) == 0)
+        {
+            long budget = deadline_budget(c->start_us, timeouts.connect_us);
+
+            /* Fall back to the next address after a stagger (RFC 8305) */
+            if (p->ai_next && budget > CONNECT_STAGGER_MS * 1000L)
+                budget = CONNECT_STAGGER_MS * 1000L;
+            c->state = CS_CONNECT;
+            twheel_arm(&c->r->wheel, &c->deadline, c->sfd, SHUT_RDWR, budget);
+            return;
+        }
+        close(c->sfd);
+        c->sfd = -1;
+    }
+
+    send_error(c, "502", "Bad Gateway",
+               "Proxy could not connect to end server");
+}
+
+/* The request's lookups finished on the offload pool */
+static void resolved(conn_t *c)
+{
+    if (c->action == REQ_RESPOND)
+    {
+        free(c->out);
+        c->out = c->resp;
+        c->outcap = c->outlen = c->resplen;
+        c->resp = NULL;
+        finish(c);
+        return;
+    }
+    c->reqlen = strlen(c->req);
+    if (c->gai_rc != 0)
+    {
+        c->ai = NULL;
+        send_error(c, "502", "Bad Gateway",
+                   "Proxy could not resolve end server");
+        return;
+    }
+    c->aip = c->ai;
+    start_connect(c);
+}
+
+/* The end server socket became writable or failed while connecting */
+static void connect_done(conn_t *c)
+{
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    if (getsockopt(c->sfd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+        err = errno;
+    if (err == EINPROGRESS)
+        return;
+    if (err && c->deadline.expired && !c->aip->ai_next)
+    {
+        send_error(c, "504", "Gateway Timeout",
+                   "End server did not accept the connection in time");
+        return;
+    }
+    if (err)
+    {
+        close(c->sfd);
+        c->sfd = -1;
+        c->aip = c->aip->ai_next;
+        start_connect(c);
+        return;
+    }
+
+    twheel_cancel(&c->r->wheel, &c->deadline);
+    c->state = CS_RELAY;
+    c->out = Realloc(c->out, EV_BUFSIZE);
+    c->outcap = EV_BUFSIZE;
+    objbuf_init(&c->obj);
+    relay(c);
+}
+
+/* The end server finished: hand the object to the cache and close */
+static void relay_done(conn_t *c)
+{
+    char *obj;
+    int size;
+
+    if (c->deadline.expired)
+    {
+        /* Truncated: never cache it, and say why if nothing was sent */
+        if (c->relayed == 0)
+            send_error(c, "504", "Gateway Timeout",
+                       "End server did not respond in time");
+        else
+            conn_close(c);
+        return;
+    }
+    if ((obj = objbuf_take(&c->obj, &size)))
+        offload_write_cache(c->uri, obj, size, now_us() - c->start);
+    hotkey_update(&hotkeys, c->uri, c->relayed);
+    conn_close(c);
+}
+
+/*
+ * Send the request, then move response bytes to the client. Upstream
+ * is only read once the client has taken everything already buffered,
+ * so a slow client throttles its end server instead of growing memory.
+ */
+static void relay(conn_t *c)
+{
+    while (c->reqoff < c->reqlen)
+    {
+        ssize_t n = send(c->sfd, c->req + c->reqoff, c->reqlen - c->reqoff,
+                         MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return;
+            if (errno == EINTR)
+                continue;
+            send_error(c, "502", "Bad Gateway",
+                       "Proxy could not send request to end server");
+            return;
+        }
+        c->reqoff += n;
+    }
+
+    while (1)
+    {
+        int rc = out_flush(c);
+        if (rc < 0)
+        {
+            conn_close(c);
+            return;
+        }
+        if (rc == 0)
+        {
+            /*
+             * Waiting on the client is not the end server idling, but a
+             * client that takes nothing for the idle time is dropped
+             */
+            twheel_arm(&c->r->wheel, &c->deadline, c->fd, SHUT_RDWR,
+                       deadline_budget(c->start_us, timeouts.idle_us));
+            return; /* Wait for the client to drain */
+        }
+        if (c->eof)
+        {
+            relay_done(c);
+            return;
+        }
+
+        ssize_t n = read(c->sfd, c->out, c->outcap);
+        if (n > 0)
+        {
+            c->outlen = n;
+            c->relayed += n;
+            objbuf_add(&c->obj, c->out, n);
+        }
+        else if (n == 0)
+            c->eof = 1;
+        else if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            /* Waiting on the end server: time its silence */
+            twheel_arm(&c->r->wheel, &c->deadline, c->sfd, SHUT_RDWR,
+                       deadline_budget(c->start_us, timeouts.idle_us));
+            return;
+        }
+        else if (errno != EINTR)
+        {
+            objbuf_free(&c->obj); /* Truncated: do not cache */
+            c->eof = 1;
+        }
+    }
+}
+
+/****************
+ * Reactor loop
+ ****************/
+
+static void accept_clients(reactor_t *r)
+{
+    struct sockaddr_storage addr;
+    socklen_t len;
+    int fd, one = 1;
+
+    while (1)
+    {
+        len = sizeof(addr);
+        if ((fd = accept(r->listenfd, (SA *)&addr, &len)) < 0)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR &&
+                errno != ECONNABORTED)
+                perror("accept");
+            return;
+        }
+        set_nonblocking(fd);
+        /*
+         * Relayed bytes go out as they arrive; with Nagle on, a short
+         * read's segment would wait for the client's delayed ACK
+         */
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        conn_t *c = Calloc(1, sizeof(conn_t));
+        c->r = r;
+        c->fd = fd;
+        c->sfd = -1;
+        c->state = CS_REQUEST;
+        c->start_us = now_us();
+        c->csrc.kind = EV_CLIENT;
+        c->ssrc.kind = EV_SERVER;
+        c->csrc.conn = c->ssrc.conn = c;
+        twtimer_init(&c->deadline);
+        http_init(&c->hreq);
+        if (ev_add(r, fd, &c->csrc) < 0)
+        {
+            c->fd = -1;
+            close(fd);
+            conn_close(c);
+            continue;
+        }
+        twheel_arm(&r->wheel, &c->deadline, fd, SHUT_RD, timeouts.header_us);
+    }
+}
+
+/* Pick up connections whose lookups completed */
+static void drain_done(reactor_t *r)
+{
+    uint64_t cnt;
+    conn_t *c, *next;
+
+    if (read(r->efd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN)
+        perror("drain_done: eventfd read");
+
+    P(&r->mutex);
+    c = r->done;
+    r->done = NULL;
+    V(&r->mutex);
+
+    for (; c; c = next)
+    {
+        next = c->next;
+        resolved(c);
+    }
+}
+
+/* Dispatch a readiness event on one of c's sockets */
+static void conn_event(conn_t *c, int kind, uint32_t events)
+{
+    if (c->closed)
+        return; /* Closed earlier in this batch */
+    if (kind == EV_CLIENT)
+    {
+        if ((events & (EPOLLERR | EPOLLHUP)) && c->state != CS_RESOLVE)
+        {
+            conn_close(c); /* Client is gone */
+            return;
+        }
+        switch (c->state)
+        {
+        case CS_REQUEST:
+            if (events & (EPOLLIN | EPOLLRDHUP))
+                read_request(c);
+            break;
+        case CS_RELAY:
+            if (events & EPOLLOUT)
+                relay(c);
+            break;
+        case CS_FLUSH:
+            if (events & EPOLLOUT)
+                finish(c);
+            break;
+        }
+        return;
+    }
+
+    switch (c->state)
+    {
+    case CS_CONNECT:
+        connect_done(c);
+        break;
+    case CS_RELAY:
+        relay(c);
+        break;
+    }
+}
+
+static void *reactor_thread(void *vargp)
+{
+    reactor_t *r = vargp;
+    struct epoll_event events[EV_MAXEVENTS];
+
+    while (1)
+    {
+        int n = epoll_wait(r->epfd, events, EV_MAXEVENTS, -1);
+        if (n < 0)
+        {
+            if (errno != EINTR)
+                unix_error("epoll_wait error");
+            continue;
+        }
+
+        for (int i = 0; i < n; i++)
+        {
+            evsrc_t *src = events[i].data.ptr;
+
+            if (src->kind == EV_LISTEN)
+                accept_clients(r);
+            else if (src->kind == EV_WAKE)
+                drain_done(r);
+            else
+                conn_event(src->conn, src->kind, events[i].events);
+        }
+
+        /* No event of this batch refers to them any more */
+        while (r->dead)
+        {
+            conn_t *c = r->dead;
+
+            r->dead = c->next;
+            Free(c);
+        }
+    }
+    return NULL;
+}
+
+/* Create a reactor that accepts from listenfd */
+static reactor_t *reactor_new(int listenfd)
+{
+    reactor_t *r = Calloc(1, sizeof(reactor_t));
+    struct epoll_event ev;
+
+    if ((r->epfd = epoll_create1(0)) < 0)
+        unix_error("epoll_create1 error");
+    if ((r->efd = eventfd(0, EFD_NONBLOCK)) < 0)
+        unix_error("eventfd error");
+    r->listenfd = listenfd;
+    r->lsrc.kind = EV_LISTEN;
+    r->wsrc.kind = EV_WAKE;
+    Sem_init(&r->mutex, 0, 1);
+    twheel_init(&r->wheel, TIMEOUT_TICK_US);
+
+    /* Only one reactor is woken per incoming connection */
+    set_nonblocking(listenfd);
+    ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+    ev.data.ptr = &r->lsrc;
+    if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, listenfd, &ev) < 0)
+        unix_error("epoll_ctl error");
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = &r->wsrc;
+    if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->efd, &ev) < 0)
+        unix_error("epoll_ctl error");
+    return r;
+}
+
+/*
+ * event_init - set up state shared by all reactors. Call once before
+ *     event_serve.
+ */
+void event_init(void)
+{
+    offload_init(EV_OFFLOAD_THREADS);
+}
+
+/* event_serve - run one reactor on listenfd in this thread. Does not return. */
+void event_serve(int listenfd)
+{
+    reactor_thread(reactor_new(listenfd));
+}
+
+/*
+ * event_run - serve listenfd with nreactors epoll reactors (one per
+ *     online CPU if nreactors <= 0). Does not return.
+ */
+void event_run(int listenfd, int nreactors)
+{
+    pthread_t tid;
+
+    if (nreactors <= 0)
+        nreactors = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nreactors <= 0)
+        nreactors = 1;
+
+    event_init();
+    for (int i = 1; i < nreactors; i++)
+        Pthread_create(&tid, NULL, reactor_thread, reactor_new(listenfd));
+    event_serve(listenfd);
+}
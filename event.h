@@ -0,0 +1,6 @@
+/*
+ * event.h - edge-triggered epoll connection engine
+ */
+void event_run(int listenfd, int nreactors);
+void event_init(void);
+void event_serve(int listenfd);
@@ -0,0 +1,121 @@
+#include "csapp.h"
+#include "hotkey.h"
+
+/*
+ * Space-Saving heavy-hitters summary (Metwally et al.). With n counters,
+ * every key whose true frequency exceeds requests/n is guaranteed to be
+ * tracked, and each count overestimates the true one by at most error.
+ */
+
+/* FNV-1a hash of a key */
+static unsigned long hotkey_hash(const char *key)
+{
+    unsigned long h = 14695981039346656037UL;
+    while (*key)
+    {
+        h ^= (unsigned char)*key++;
+        h *= 1099511628211UL;
+    }
+    return h;
+}
+
+/* Create an empty summary with n counters */
+void hotkey_init(hotkey_t *hp, int n)
+{
+    hp->counters = Calloc(n, sizeof(hotcounter_t));
+    hp->n = n;
+    hp->used = 0;
+    hp->requests = 0;
+    hp->bytes = 0;
+    Sem_init(&hp->mutex, 0, 1);
+}
+
+/* Clean up summary hp */
+void hotkey_deinit(hotkey_t *hp)
+{
+    Free(hp->counters);
+}
+
+/* Count one request for key that transferred bytes bytes */
+void hotkey_update(hotkey_t *hp, const char *key, long bytes)
+{
+    unsigned long h = hotkey_hash(key);
+    hotcounter_t *c = NULL, *min = NULL;
+    int i;
+
+    P(&hp->mutex);
+    hp->requests++;
+    hp->bytes += bytes;
+
+    for (i = 0; i < hp->used; i++)
+    {
+        hotcounter_t *cp = &hp->counters[i];
+        if (cp->hash == h && !strncmp(cp->key, key, HOTKEY_KEYLEN - 1))
+        {
+            c = cp;
+            break;
+        }
+        if (!min || cp->count < min->count)
+            min = cp;
+    }
+
+    if (!c)
+    {
+        if (hp->used < hp->n)
+        {
+            /* Free counter: count is exact */
+            c = &hp->counters[hp->used++];
+            c->count = c->error = c->bytes = 0;
+        }
+        else
+        {
+            /* Replace the minimum, inheriting its count as error */
+            c = min;
+            c->error = c->count;
+        }
+        c->hash = h;
+        strncpy(c->key, key, HOTKEY_KEYLEN - 1);
+        c->key[HOTKEY_KEYLEN - 1] = '\0';
+    }
+    c->count++;
+    c->bytes += bytes;
+    V(&hp->mutex);
+}
+
+/* Order counters by decreasing count */
+static int hotkey_cmp(const void *a, const void *b)
+{
+    const hotcounter_t *x = a, *y = b;
+    return (x->count < y->count) - (x->count > y->count);
+}
+
+/* Format the top k keys into buf - returns bytes written */
+int hotkey_report(hotkey_t *hp, int k, char *buf, size_t bufsz)
+{
+    hotcounter_t *snap;
+    int used, i;
+    size_t n;
+    long requests, bytes;
+
+    snap = Malloc(hp->n * sizeof(hotcounter_t));
+    P(&hp->mutex);
+    used = hp->used;
+    requests = hp->requests;
+    bytes = hp->bytes;
+    memcpy(snap, hp->counters, used * sizeof(hotcounter_t));
+    V(&hp->mutex);
+
+    qsort(snap, used, sizeof(hotcounter_t), hotkey_cmp);
+    if (k > used)
+        k = used;
+
+    n = snprintf(buf, bufsz, "hotkeys: %ld requests, %ld bytes\n"
+                             "%-5s %10s %10s %12s  %s\n",
+                 requests, bytes, "rank", "requests", "error", "bytes", "key");
+    for (i = 0; i < k && n < bufsz; i++)
+        n += snprintf(buf + n, bufsz - n, "%-5d %10ld %10ld %12ld  %s\n",
+                      i + 1, snap[i].count, snap[i].error, snap[i].bytes,
+                      snap[i].key);
+    Free(snap);
+    return n < bufsz ? n : bufsz - 1;
+}
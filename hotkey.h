@@ -0,0 +1,25 @@
+#define HOTKEY_KEYLEN 256
+
+typedef struct
+{
+    char key[HOTKEY_KEYLEN]; /* Key (truncated) */
+    unsigned long hash;      /* Hash of the full key */
+    long count;              /* Estimated requests (upper bound) */
+    long error;              /* Maximum overestimation of count */
+    long bytes;              /* Estimated bytes (upper bound) */
+} hotcounter_t;
+
+typedef struct
+{
+    hotcounter_t *counters; /* Counter array */
+    int n;                  /* Maximum number of counters */
+    int used;               /* Counters in use */
+    long requests;          /* Total requests seen */
+    long bytes;             /* Total bytes seen */
+    sem_t mutex;            /* Protects accesses to counters */
+} hotkey_t;
+
+void hotkey_init(hotkey_t *hp, int n);
+void hotkey_deinit(hotkey_t *hp);
+void hotkey_update(hotkey_t *hp, const char *key, long bytes);
+int hotkey_report(hotkey_t *hp, int k, char *buf, size_t bufsz);
@@ -0,0 +1,243 @@
+/*
+ * http.c - request head parsing and header field classification
+ *
+ * The parser tokenizes a request head where it lies in the connection's
+ * read buffer: the request line and each header field are recorded as
+ * offset/length views into the buffer, and nothing is copied. It is
+ * called again each time more bytes arrive and resumes where it left
+ * off, so a head split across any number of reads is scanned once. The
+ * buffer must start at the head's first byte on every call, though its
+ * contents may have moved in between.
+ *
+ * Header names the proxy acts on are recognized by a perfect hash of
+ * their length and first and last letters, confirmed by a case-folded
+ * compare done eight bytes at a time.
+ */
+#include "csapp.h"
+#include "http.h"
+
+void http_init(http_req_t *r)
+{
+    memset(r, 0, sizeof(*r));
+}
+
+static int is_ws(char c)
+{
+    return c == ' ' || c == '\t';
+}
+
+/* View the next whitespace-delimited token of buf[*pos, end) */
+static int next_token(const char *buf, size_t *pos, size_t end, hview_t *v)
+{
+    size_t p = *pos;
+
+    while (p < end && is_ws(buf[p]))
+        p++;
+    v->off = p;
+    while (p < end && !is_ws(buf[p]))
+        p++;
+    v->len = p - v->off;
+    *pos = p;
+    return v->len > 0 ? 0 : -1;
+}
+
+/* Request line: method, target and version, separated by whitespace */
+static int parse_request_line(http_req_t *r, const char *buf,
+                              size_t start, size_t end)
+{
+    size_t pos = start;
+
+    if (next_token(buf, &pos, end, &r->method) < 0 ||
+        next_token(buf, &pos, end, &r->uri) < 0 ||
+        next_token(buf, &pos, end, &r->version) < 0)
+        return HTTP_BAD;
+    return HTTP_MORE;
+}
+
+/* Header field "name: value" on buf[start, end), its line ending at eol */
+static int parse_field(http_req_t *r, const char *buf,
+                       size_t start, size_t end, size_t eol)
+{
+    const char *colon;
+    hfield_t *f;
+    size_t p, q;
+
+    /* Obsolete line folding is refused (RFC 9112, section 5.2) */
+    if (is_ws(buf[start]) ||
+        !(colon = memchr(buf + start, ':', end - start)) ||
+        colon == buf + start)
+        return HTTP_BAD;
+    /* No whitespace is allowed in the name, or before the colon */
+    for (p = start; buf + p < colon; p++)
+        if (is_ws(buf[p]))
+            return HTTP_BAD;
+    if (r->nfields == HTTP_MAX_FIELDS)
+        return HTTP_TOOBIG;
+
+    f = &r->fields[r->nfields++];
+    f->name.off = start;
+    f->name.len = colon - (buf + start);
+    for (p = colon + 1 - buf; p < end && is_ws(buf[p]); p++)
+        ;
+    for (q = end; q > p && is_ws(buf[q - 1]); q--)
+        ;
+    f->value.off = p;
+    f->value.len = q - p;
+    f->line.off = start;
+    f->line.len = eol - start;
+    return HTTP_MORE;
+}
+
+/*
+ * http_parse - parse more of the request head held in the first n bytes
+ *     of buf. Returns HTTP_DONE once the blank line ending the head is
+ *     seen (r->len is then the head's length), HTTP_MORE if the head
+ *     goes on past buf[n - 1], or HTTP_BAD or HTTP_TOOBIG.
+ */
+int http_parse(http_req_t *r, const char *buf, size_t n)
+{
+    while (r->scan < n)
+    {
+        const char *nl = memchr(buf + r->scan, '\n', n - r->scan);
+        size_t start = r->line, end, eol;
+        int rc;
+
+        if (!nl)
+        {
+            r->scan = n;
+            break;
+        }
+        eol = nl + 1 - buf;
+        end = nl - buf;
+        if (end > start && buf[end - 1] == '\r')
+            end--;
+        r->scan = r->line = eol;
+
+        if (r->method.len == 0)
+        {
+            /* Blank lines before the request line are ignored */
+            if (end == start)
+                continue;
+            rc = parse_request_line(r, buf, start, end);
+        }
+        else if (end == start)
+        {
+            r->len = eol;
+            return HTTP_DONE;
+        }
+        else
+            rc = parse_field(r, buf, start, end, eol);
+        if (rc != HTTP_MORE)
+            return rc;
+    }
+    return HTTP_MORE;
+}
+
+/* Is the view v of buf the string s, ignoring case? */
+int http_is(const char *buf, hview_t v, const char *s)
+{
+    return (size_t)v.len == strlen(s) && !strncasecmp(buf + v.off, s, v.len);
+}
+
+/*
+ * Slot of a name of length len with first and last letters f and l in
+ * lower case; collision-free for the names below
+ */
+#define HF_SLOTS 32
+#define HF_SLOT(len, f, l) (((len) + 14 * (f) + (l)) % HF_SLOTS)
+#define HF_ENTRY(s, c0, cn, id) \
+    [HF_SLOT(sizeof(s) - 1, c0, cn)] = {s, sizeof(s) - 1, id}
+
+static const struct
+{
+    const char *name; /* In lower case */
+    size_t len;
+    int id;
+} hf_table[HF_SLOTS] = {
+    HF_ENTRY("host", 'h', 't', HF_HOST),
+    HF_ENTRY("user-agent", 'u', 't', HF_USER_AGENT),
+    HF_ENTRY("connection", 'c', 'n', HF_CONNECTION),
+    HF_ENTRY("proxy-connection", 'p', 'n', HF_PROXY_CONNECTION),
+    HF_ENTRY("keep-alive", 'k', 'e', HF_KEEP_ALIVE),
+    HF_ENTRY("te", 't', 'e', HF_TE),
+    HF_ENTRY("trailer", 't', 'r', HF_TRAILER),
+    HF_ENTRY("upgrade", 'u', 'e', HF_UPGRADE),
+    HF_ENTRY("proxy-authenticate", 'p', 'e', HF_PROXY_AUTHENTICATE),
+    HF_ENTRY("proxy-authorization", 'p', 'n', HF_PROXY_AUTHORIZATION),
+    HF_ENTRY("transfer-encoding", 't', 'g', HF_TRANSFER_ENCODING),
+    HF_ENTRY("if-none-match", 'i', 'h', HF_IF_NONE_MATCH),
+    HF_ENTRY("if-modified-since", 'i', 'e', HF_IF_MODIFIED_SINCE),
+    HF_ENTRY("content-length", 'c', 'h', HF_CONTENT_LENGTH),
+};
+
+/*
+ * Do the n bytes at s, folded to lower case, equal lc? Setting bit 5
+ * folds letters, and leaves the digits and '-' of the table's names as
+ * they are.
+ */
+static int fold_eq(const char *s, const char *lc, size_t n)
+{
+    unsigned long long a, b;
+
+    for (; n >= 8; s += 8, lc += 8, n -= 8)
+    {
+        memcpy(&a, s, 8);
+        memcpy(&b, lc, 8);
+        if ((a | 0x2020202020202020ULL) != b)
+            return 0;
+    }
+    for (; n > 0; s++, lc++, n--)
+        if ((*s | 0x20) != *lc)
+            return 0;
+    return 1;
+}
+
+/* Classify the header name of len bytes at name: HF_* */
+int http_field(const char *name, size_t len)
+{
+    unsigned f, l;
+
+    if (len == 0)
+        return HF_OTHER;
+    f = (unsigned char)name[0] | 0x20;
+    l = (unsigned char)name[len - 1] | 0x20;
+    if (hf_table[HF_SLOT(len, f, l)].len == len &&
+        fold_eq(name, hf_table[HF_SLOT(len, f, l)].name, len))
+        return hf_table[HF_SLOT(len, f, l)].id;
+    return HF_OTHER;
+}
+
+/*
+ * http_listed_add - note the field names in the Connection header value
+ *     val (len bytes); names past HTTP_MAX_LISTED are ignored. l must
+ *     start zeroed.
+ */
+void http_listed_add(http_listed_t *l, const char *val, size_t len)
+{
+    const char *end = val + len;
+
+    while (val < end && l->n < HTTP_MAX_LISTED)
+    {
+        const char *p;
+
+        while (val < end && (*val == ',' || is_ws(*val)))
+            val++;
+        for (p = val; p < end && *p != ',' && !is_ws(*p); p++)
+            ;
+        if (p > val)
+        {
+            l->name[l->n] = val;
+            l->len[l->n++] = p - val;
+        }
+        val = p;
+    }
+}
+
+/* Does l list the header name of len bytes at name? */
+int http_listed(const http_listed_t *l, const char *name, size_t len)
+{
+    for (int i = 0; i < l->n; i++)
+        if ((size_t)l->len[i] == len && !strncasecmp(l->name[i], name, len))
+            return 1;
+    return 0;
+}
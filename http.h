@@ -0,0 +1,71 @@
+/*
+ * http.h - request head parsing and header field classification
+ */
+#define HTTP_MAX_FIELDS 64 /* Header fields kept per request */
+#define HTTP_MAX_LISTED 16 /* Field names kept per Connection list */
+
+/* Results of http_parse */
+#define HTTP_MORE 0    /* The head is not complete yet */
+#define HTTP_DONE 1    /* The head is complete */
+#define HTTP_BAD -1    /* Malformed */
+#define HTTP_TOOBIG -2 /* Too many header fields */
+
+/*
+ * A run of bytes in the buffer being parsed, kept as an offset so that
+ * it survives the buffer's contents moving
+ */
+typedef struct
+{
+    int off, len;
+} hview_t;
+
+typedef struct
+{
+    hview_t name;
+    hview_t value; /* Without surrounding whitespace */
+    hview_t line;  /* The whole line, line break included */
+} hfield_t;
+
+typedef struct
+{
+    size_t scan;   /* Bytes searched for a line break so far */
+    size_t line;   /* Start of the line being parsed */
+    size_t len;    /* Length of the head, once complete */
+    hview_t method, uri, version;
+    int nfields;
+    hfield_t fields[HTTP_MAX_FIELDS];
+} http_req_t;
+
+/* Header fields the proxy acts on, as classified by http_field */
+#define HF_OTHER 0
+#define HF_HOST 1
+#define HF_USER_AGENT 2
+#define HF_CONNECTION 3       /* Hop-by-hop (RFC 9110, section 7.6.1) */
+#define HF_PROXY_CONNECTION 4 /*   ... from here */
+#define HF_KEEP_ALIVE 5
+#define HF_TE 6
+#define HF_TRAILER 7
+#define HF_UPGRADE 8
+#define HF_PROXY_AUTHENTICATE 9
+#define HF_PROXY_AUTHORIZATION 10 /*   ... to here */
+#define HF_TRANSFER_ENCODING 11 /* Hop-by-hop, but tied to the body */
+#define HF_IF_NONE_MATCH 12
+#define HF_IF_MODIFIED_SINCE 13
+#define HF_CONTENT_LENGTH 14
+
+#define HF_HOP_BY_HOP(id) ((id) >= HF_CONNECTION && (id) <= HF_PROXY_AUTHORIZATION)
+
+/* Field names a Connection header lists as hop-by-hop */
+typedef struct
+{
+    int n;
+    const char *name[HTTP_MAX_LISTED];
+    int len[HTTP_MAX_LISTED];
+} http_listed_t;
+
+void http_init(http_req_t *r);
+int http_parse(http_req_t *r, const char *buf, size_t n);
+int http_is(const char *buf, hview_t v, const char *s);
+int http_field(const char *name, size_t len);
+void http_listed_add(http_listed_t *l, const char *val, size_t len);
+int http_listed(const http_listed_t *l, const char *name, size_t len);
@@ -0,0 +1,186 @@
+/*
+ * linebench.c - measure the cost of reading header lines through rio
+ *
+ * usage: linebench [passes]
+ *
+ * Reads a file of typical request headers line by line, once with the
+ * original byte-at-a-time rio_readlineb (reproduced here for reference),
+ * once with the current one, which copies whole runs found with memchr,
+ * and once with rio_readlinep, which hands back lines in place. Reports
+ * nanoseconds and, on x86, TSC cycles per header byte.
+ */
+#include "csapp.h"
+
+#define BENCH_BYTES (4 << 20) /* Size of the header file */
+#define DEFAULT_PASSES 20
+
+static const char header[] =
+    "GET http://www.example.com/assets/img/logo.png?v=12 HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) "
+    "Gecko/20100101 Firefox/115.0\r\n"
+    "Accept: image/avif,image/webp,*/*\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Referer: http://www.example.com/index.html\r\n"
+    "Connection: keep-alive\r\n"
+    "Cookie: session=4f2a9c1e8b7d6a5f3e2d1c0b; theme=dark\r\n"
+    "If-None-Match: \"5d8c72a5edda8d6a:0\"\r\n"
+    "\r\n";
+
+static long bench_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static unsigned long bench_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    return 0;
+#endif
+}
+
+/* The original rio_read and rio_readlineb, one rio_read call per byte */
+static ssize_t classic_read(rio_t *rp, char *usrbuf, size_t n)
+{
+    int cnt;
+
+    while (rp->rio_cnt <= 0)
+    {
+        rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, sizeof(rp->rio_buf));
+        if (rp->rio_cnt < 0)
+        {
+            if (errno != EINTR)
+                return -1;
+        }
+        else if (rp->rio_cnt == 0)
+            return 0;
+        else
+            rp->rio_bufptr = rp->rio_buf;
+    }
+    cnt = n;
+    if (rp->rio_cnt < n)
+        cnt = rp->rio_cnt;
+    memcpy(usrbuf, rp->rio_bufptr, cnt);
+    rp->rio_bufptr += cnt;
+    rp->rio_cnt -= cnt;
+    return cnt;
+}
+
+static ssize_t classic_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
+{
+    int n, rc;
+    char c, *bufp = usrbuf;
+
+    for (n = 1; n < maxlen; n++)
+    {
+        if ((rc = classic_read(rp, &c, 1)) == 1)
+        {
+            *bufp++ = c;
+            if (c == '\n')
+            {
+                n++;
+                break;
+            }
+        }
+        else if (rc == 0)
+        {
+            if (n == 1)
+                return 0;
+            else
+                break;
+        }
+        else
+            return -1;
+    }
+    *bufp = 0;
+    return n - 1;
+}
+
+static ssize_t copy_classic(rio_t *rp, char **linep)
+{
+    static char line[MAXLINE];
+
+    *linep = line;
+    return classic_readlineb(rp, line, sizeof(line));
+}
+
+static ssize_t copy_memchr(rio_t *rp, char **linep)
+{
+    static char line[MAXLINE];
+
+    *linep = line;
+    return rio_readlineb(rp, line, sizeof(line));
+}
+
+typedef struct
+{
+    const char *name;
+    ssize_t (*readline)(rio_t *rp, char **linep);
+} reader_t;
+
+static const reader_t readers[] = {
+    {"byte-at-a-time rio_readlineb", copy_classic},
+    {"memchr rio_readlineb", copy_memchr},
+    {"in-place rio_readlinep", rio_readlinep},
+};
+
+int main(int argc, char **argv)
+{
+    int passes = argc > 1 ? atoi(argv[1]) : DEFAULT_PASSES;
+    FILE *fp = tmpfile();
+    int fd, i, p;
+    long total = 0, lines = 0;
+
+    if (!fp || passes <= 0)
+    {
+        fprintf(stderr, "usage: %s [passes]\n", argv[0]);
+        exit(1);
+    }
+    fd = fileno(fp);
+    for (; total + (long)sizeof(header) - 1 <= BENCH_BYTES;
+         total += sizeof(header) - 1)
+        Rio_writen(fd, (void *)header, sizeof(header) - 1);
+
+    for (i = 0; i < (int)(sizeof(readers) / sizeof(readers[0])); i++)
+    {
+        long start = 0, ns, bytes = 0;
+        unsigned long cycles = 0;
+
+        /* The first pass warms the page cache and is not timed */
+        for (p = 0; p <= passes; p++)
+        {
+            rio_t rio;
+            char *line;
+            ssize_t n;
+            unsigned long c0;
+
+            lseek(fd, 0, SEEK_SET);
+            rio_readinitb(&rio, fd);
+            if (p == 1)
+                start = bench_now_ns();
+            c0 = bench_cycles();
+            lines = 0;
+            while ((n = readers[i].readline(&rio, &line)) > 0)
+            {
+                if (p > 0)
+                    bytes += n;
+                lines++;
+            }
+            if (p > 0)
+                cycles += bench_cycles() - c0;
+        }
+        ns = bench_now_ns() - start;
+        printf("%-30s %6.2f ns/byte", readers[i].name, (double)ns / bytes);
+        if (cycles)
+            printf(" %6.2f cycles/byte", (double)cycles / bytes);
+        printf("  (%ld lines/pass)\n", lines);
+    }
+    fclose(fp);
+    exit(0);
+}
@@ -0,0 +1,136 @@
+#include <string.h>
+#include "lz.h"
+
+/*
+ * The compressed stream is a sequence of tokens:
+ *
+ *   000LLLLL <L+1 literal bytes>             literal run of 1..32 bytes
+ *   LLLooooo oooooooo                        match of L+2 bytes (L < 7)
+ *   111ooooo LLLLLLLL oooooooo               match of L+9 bytes
+ *
+ * where o is the 13-bit distance minus one back into the output. Matches
+ * are found through a hash table of the last position of each 3-byte
+ * prefix, so compression is a single greedy pass with no allocation.
+ */
+
+#define LZ_HASH_LOG 13
+#define LZ_HASH_SIZE (1 << LZ_HASH_LOG)
+#define LZ_MAX_LIT 32
+#define LZ_MAX_OFF (1 << 13)
+#define LZ_MAX_REF ((1 << 8) + (1 << 3))
+
+static unsigned lz_hash(const unsigned char *p)
+{
+    unsigned v = (p[0] << 16) | (p[1] << 8) | p[2];
+    return ((v * 2654435761u) >> (32 - LZ_HASH_LOG)) & (LZ_HASH_SIZE - 1);
+}
+
+/*
+ * lz_compress - compress inlen bytes into out. Returns the compressed
+ *     size, or 0 if it would not fit in outcap bytes.
+ */
+int lz_compress(const void *in, int inlen, void *out, int outcap)
+{
+    const unsigned char *ip = in, *iend = ip + inlen;
+    const unsigned char *htab[LZ_HASH_SIZE];
+    unsigned char *op = out, *oend = op + outcap;
+    unsigned char *lit = NULL; /* Control byte of the open literal run */
+
+    memset(htab, 0, sizeof(htab));
+
+    while (ip < iend)
+    {
+        if (iend - ip >= 3)
+        {
+            unsigned h = lz_hash(ip);
+            const unsigned char *ref = htab[h];
+            htab[h] = ip;
+
+            if (ref && ip - ref <= LZ_MAX_OFF && ref[0] == ip[0] &&
+                ref[1] == ip[1] && ref[2] == ip[2])
+            {
+                int off = ip - ref - 1, len = 3;
+                int maxlen = iend - ip;
+                if (maxlen > LZ_MAX_REF)
+                    maxlen = LZ_MAX_REF;
+                while (len < maxlen && ref[len] == ip[len])
+                    len++;
+
+                if (oend - op < 3)
+                    return 0;
+                len -= 2;
+                if (len < 7)
+                    *op++ = (len << 5) | (off >> 8);
+                else
+                {
+                    *op++ = (7 << 5) | (off >> 8);
+                    *op++ = len - 7;
+                }
+                *op++ = off & 0xff;
+                lit = NULL;
+                ip += len + 2;
+                continue;
+            }
+        }
+
+        /* Append one literal, opening a new run if needed */
+        if (!lit || *lit == LZ_MAX_LIT - 1)
+        {
+            if (oend - op < 2)
+                return 0;
+            lit = op++;
+            *lit = (unsigned char)-1;
+        }
+        else if (op == oend)
+            return 0;
+        (*lit)++;
+        *op++ = *ip++;
+    }
+    return op - (unsigned char *)out;
+}
+
+/*
+ * lz_decompress - expand inlen compressed bytes into out. Returns the
+ *     decompressed size, or -1 if the input is corrupt or the output
+ *     would exceed outcap bytes.
+ */
+int lz_decompress(const void *in, int inlen, void *out, int outcap)
+{
+    const unsigned char *ip = in, *iend = ip + inlen;
+    unsigned char *op = out, *oend = op + outcap;
+
+    while (ip < iend)
+    {
+        unsigned ctrl = *ip++;
+
+        if (ctrl < (1 << 5))
+        {
+            int n = ctrl + 1;
+            if (iend - ip < n || oend - op < n)
+                return -1;
+            memcpy(op, ip, n);
+            op += n;
+            ip += n;
+        }
+        else
+        {
+            int len = ctrl >> 5;
+            const unsigned char *ref;
+            if (len == 7)
+            {
+                if (ip >= iend)
+                    return -1;
+                len += *ip++;
+            }
+            len += 2;
+            if (ip >= iend)
+                return -1;
+            ref = op - ((ctrl & 0x1f) << 8) - *ip++ - 1;
+            if (ref < (unsigned char *)out || oend - op < len)
+                return -1;
+            while (len--) /* Byte copy: source may overlap destination */
+                *op++ = *ref++;
+        }
+    }
+    return op - (unsigned char *)out;
+}
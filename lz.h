@@ -0,0 +1,5 @@
+/*
+ * lz - small LZ77 compressor for cached text objects (LZF-style format)
+ */
+int lz_compress(const void *in, int inlen, void *out, int outcap);
+int lz_decompress(const void *in, int inlen, void *out, int outcap);
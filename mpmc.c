@@ -0,0 +1,178 @@
+/*
+ * mpmc.c - bounded lock-free multi-producer/multi-consumer FIFO
+ *
+ * Drop-in replacement for sbuf. Each slot carries a sequence number
+ * that says whether it is ready for the producer or the consumer of a
+ * given lap around the array (D. Vyukov's bounded MPMC queue), so an
+ * insert or remove is one CAS on tail or head and no lock is taken.
+ * Threads only enter the kernel, through a futex, when the queue is
+ * empty (consumers) or full (producers), and the other side only makes
+ * a wake syscall when someone is actually asleep.
+ */
+#include "csapp.h"
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "mpmc.h"
+
+/* Sleep while *addr == val (or until woken) */
+void futex_wait(unsigned *addr, unsigned val)
+{
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+/* Like futex_wait, but gives up after timeout_us; -1 with ETIMEDOUT then */
+int futex_timedwait(unsigned *addr, unsigned val, long timeout_us)
+{
+    struct timespec ts;
+
+    ts.tv_sec = timeout_us / 1000000;
+    ts.tv_nsec = (timeout_us % 1000000) * 1000;
+    return syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, &ts, NULL, 0);
+}
+
+/* Wake one thread sleeping on addr */
+void futex_wake(unsigned *addr)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+/* Wake one sleeper on ev, if there is one */
+static void wake_one(unsigned *ev, int *waiters)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(waiters, __ATOMIC_SEQ_CST) > 0)
+    {
+        __atomic_fetch_add(ev, 1, __ATOMIC_SEQ_CST);
+        futex_wake(ev);
+    }
+}
+
+/* Create an empty, bounded, shared FIFO with at least n slots */
+void mpmc_init(mpmc_t *q, int n)
+{
+    unsigned size = 1;
+
+    while (size < (unsigned)n)
+        size <<= 1;
+    memset(q, 0, sizeof(*q));
+    q->slots = Calloc(size, sizeof(mpmc_slot_t));
+    q->mask = size - 1;
+    for (unsigned i = 0; i < size; i++)
+        q->slots[i].seq = i; /* Slot i is first free for insert number i */
+}
+
+/* Clean up queue q */
+void mpmc_deinit(mpmc_t *q)
+{
+    Free(q->slots);
+}
+
+/* Insert item at the rear of q if there is room; returns 0 if full */
+int mpmc_tryinsert(mpmc_t *q, int item)
+{
+    mpmc_slot_t *slot;
+    unsigned pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+
+    while (1)
+    {
+        int diff;
+
+        slot = &q->slots[pos & q->mask];
+        diff = (int)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0)
+        {
+            /* Slot is free for this lap: claim it */
+            if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+                break;
+        }
+        else if (diff < 0)
+            return 0; /* Still holds last lap's item: full */
+        else
+            pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    }
+
+    slot->item = item;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+    wake_one(&q->items_ev, &q->items_waiters);
+    return 1;
+}
+
+/* Remove the first item of q into *item; returns 0 if empty */
+int mpmc_tryremove(mpmc_t *q, int *item)
+{
+    mpmc_slot_t *slot;
+    unsigned pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+
+    while (1)
+    {
+        int diff;
+
+        slot = &q->slots[pos & q->mask];
+        diff = (int)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) -
+                     (pos + 1));
+        if (diff == 0)
+        {
+            /* Slot holds this lap's item: claim it */
+            if (__atomic_compare_exchange_n(&q->head, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+                break;
+        }
+        else if (diff < 0)
+            return 0; /* Not written yet: empty */
+        else
+            pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+    }
+
+    *item = slot->item;
+    /* Free the slot for the insert one lap ahead */
+    __atomic_store_n(&slot->seq, pos + q->mask + 1, __ATOMIC_RELEASE);
+    wake_one(&q->slots_ev, &q->slots_waiters);
+    return 1;
+}
+
+/*
+ * Sleep on ev until try() succeeds. The waiter count is raised before
+ * the final retry, so a thread that makes progress after that retry
+ * sees the count and bumps ev, which either fails our futex_wait or
+ * wakes it.
+ */
+#define MPMC_BLOCK(q, ev, waiters, try) \
+    while (!(try))                                                      \
+    {                                                                   \
+        unsigned seen = __atomic_load_n(&(q)->ev, __ATOMIC_SEQ_CST);    \
+        __atomic_fetch_add(&(q)->waiters, 1, __ATOMIC_SEQ_CST);         \
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);                        \
+        if (try)                                                        \
+        {                                                               \
+            __atomic_fetch_sub(&(q)->waiters, 1, __ATOMIC_SEQ_CST);     \
+            break;                                                      \
+        }                                                               \
+        futex_wait(&(q)->ev, seen);                                     \
+        __atomic_fetch_sub(&(q)->waiters, 1, __ATOMIC_SEQ_CST);         \
+    }
+
+/* Insert item at the rear of q, waiting while q is full */
+void mpmc_insert(mpmc_t *q, int item)
+{
+    MPMC_BLOCK(q, slots_ev, slots_waiters, mpmc_tryinsert(q, item));
+}
+
+/* Remove and return the first item of q, waiting while q is empty */
+int mpmc_remove(mpmc_t *q)
+{
+    int item;
+
+    MPMC_BLOCK(q, items_ev, items_waiters, mpmc_tryremove(q, &item));
+    return item;
+}
+
+/* Approximate number of items in q */
+int mpmc_count(mpmc_t *q)
+{
+    int n = (int)(__atomic_load_n(&q->tail, __ATOMIC_RELAXED) -
+                  __atomic_load_n(&q->head, __ATOMIC_RELAXED));
+    return n < 0 ? 0 : n;
+}
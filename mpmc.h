@@ -0,0 +1,34 @@
+/*
+ * mpmc.h - bounded lock-free multi-producer/multi-consumer FIFO
+ */
+#define MPMC_CACHE_LINE 64
+
+typedef struct
+{
+    unsigned seq; /* Turn number: whose turn it is to use this slot */
+    int item;
+} mpmc_slot_t;
+
+typedef struct
+{
+    mpmc_slot_t *slots; /* Slot array, a power of two long */
+    unsigned mask;      /* Number of slots minus one */
+    unsigned head __attribute__((aligned(MPMC_CACHE_LINE))); /* Next remove */
+    unsigned tail __attribute__((aligned(MPMC_CACHE_LINE))); /* Next insert */
+    /* Futex words and sleeper counts for blocking when empty or full */
+    unsigned items_ev __attribute__((aligned(MPMC_CACHE_LINE)));
+    int items_waiters;
+    unsigned slots_ev __attribute__((aligned(MPMC_CACHE_LINE)));
+    int slots_waiters;
+} mpmc_t;
+
+void mpmc_init(mpmc_t *q, int n);
+void mpmc_deinit(mpmc_t *q);
+int mpmc_tryinsert(mpmc_t *q, int item);
+int mpmc_tryremove(mpmc_t *q, int *item);
+void mpmc_insert(mpmc_t *q, int item);
+int mpmc_remove(mpmc_t *q);
+int mpmc_count(mpmc_t *q);
+void futex_wait(unsigned *addr, unsigned val);
+int futex_timedwait(unsigned *addr, unsigned val, long timeout_us);
+void futex_wake(unsigned *addr);
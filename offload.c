@@ -0,0 +1,89 @@
+#include "csapp.h"
+#include "http.h"
+#include "hotkey.h"
+#include "proxy.h"
+#include "offload.h"
+
+/* Insertion into the cache, handed off by a reactor */
+typedef struct
+{
+    task_t task; /* Must be first */
+    char url[MAXLINE];
+    char *buf;
+    int size;
+    long fetch_us;
+} cachetask_t;
+
+/* Shared FIFO of pending tasks */
+static struct
+{
+    task_t *head, *tail;
+    sem_t mutex; /* Protects head and tail */
+    sem_t items; /* Counts queued tasks */
+} offload;
+
+static void *offload_thread(void *vargp)
+{
+    Pthread_detach(pthread_self());
+    while (1)
+    {
+        task_t *tp;
+
+        P(&offload.items);
+        P(&offload.mutex);
+        tp = offload.head;
+        offload.head = tp->next;
+        if (!offload.head)
+            offload.tail = NULL;
+        V(&offload.mutex);
+
+        tp->run(tp);
+    }
+    return NULL;
+}
+
+/* Start nthreads offload threads */
+void offload_init(int nthreads)
+{
+    pthread_t tid;
+
+    Sem_init(&offload.mutex, 0, 1);
+    Sem_init(&offload.items, 0, 0);
+    for (int i = 0; i < nthreads; i++)
+        Pthread_create(&tid, NULL, offload_thread, NULL);
+}
+
+/* Queue tp to run on an offload thread; never blocks for long */
+void offload_submit(task_t *tp)
+{
+    tp->next = NULL;
+    P(&offload.mutex);
+    if (offload.tail)
+        offload.tail->next = tp;
+    else
+        offload.head = tp;
+    offload.tail = tp;
+    V(&offload.mutex);
+    V(&offload.items);
+}
+
+static void cache_task(task_t *tp)
+{
+    cachetask_t *ct = (cachetask_t *)tp;
+
+    write_cache(ct->buf, ct->url, ct->size, ct->fetch_us);
+    Free(ct);
+}
+
+/* Insert an object into the cache off-thread, taking ownership of buf */
+void offload_write_cache(char *url, char *buf, int size, long fetch_us)
+{
+    cachetask_t *ct = Malloc(sizeof(cachetask_t));
+
+    strcpy(ct->url, url);
+    ct->buf = buf;
+    ct->size = size;
+    ct->fetch_us = fetch_us;
+    ct->task.run = cache_task;
+    offload_submit(&ct->task);
+}
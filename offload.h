@@ -0,0 +1,15 @@
+/*
+ * offload.h - thread pool for blocking work handed off by the
+ *     event-driven engines
+ */
+
+/* Unit of blocking work; embed as the first member of a larger struct */
+typedef struct task
+{
+    struct task *next;
+    void (*run)(struct task *tp);
+} task_t;
+
+void offload_init(int nthreads);
+void offload_submit(task_t *tp);
+void offload_write_cache(char *url, char *buf, int size, long fetch_us);
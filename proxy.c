@@ -1,28 +1,168 @@
 #include <stdio.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
 #include "csapp.h"
-#include "sbuf.h"
+#include "mpmc.h"
+#include "wpool.h"
+#include "twheel.h"
+#include "connpool.h"
+#include "chunked.h"
+#include "http.h"
+#include "hotkey.h"
+#include "lz.h"
+#include "proxy.h"
+#include "event.h"
+#include "uring.h"
 
-/* Recommended max cache and object sizes */
-#define MAX_CACHE_SIZE 1049000
-#define MAX_OBJECT_SIZE 102400
-#define CACHE_LINE 10
+#define CACHE_LINE 128
 
-#define NTHREADS 4
-#define SBUFSIZE 16
+#define MIN_THREADS 4  /* Default bounds on the fetch pool size */
+#define MAX_THREADS 64
+#define LANE_MIN_THREADS 2  /* Bounds on the fast-lane pool size */
+#define LANE_MAX_THREADS 16
+#define SBUFSIZE 16 /* Queued connections per worker */
+#define SHED_RETRY_AFTER 2 /* Seconds clients turned away should wait */
+#define PARK_EVENTS 64 /* Parked connections woken per epoll_wait */
+
+/* Default limits on idle persistent end server connections */
+#define POOL_PER_ORIGIN 8
+#define POOL_MAX_IDLE 256
+#define POOL_IDLE_TIMEOUT 10 /* Seconds */
+
+#define RESP_HDR_MAX (2 * MAXBUF) /* Largest end server response header */
+#define CONN_HDR_ROOM 32 /* Room for the Connection header we add */
+#define CHUNK_SIZE_ROOM 20 /* Room for a chunk-size line we write */
+#define SPLICE_CHUNK 65536 /* Bytes moved per splice, a default pipe's capacity */
+#ifndef SPLICE_F_MOVE
+#define SPLICE_F_MOVE 1 /* Only declared for _GNU_SOURCE */
+#endif
+
+/* How the end of a response body is found */
+#define FRAME_NONE 0    /* There is no body (1xx, 204, 304) */
+#define FRAME_LENGTH 1  /* After Content-Length bytes */
+#define FRAME_CHUNKED 2 /* At the last chunk */
+#define FRAME_EOF 3     /* When the end server closes */
+
+/* What the head of a response says to keep for the cache */
+#define CACHE_SKIP 0  /* Nothing */
+#define CACHE_GROW -1 /* All of it, its size only known at the end */
+                      /* Otherwise the object's exact size */
+#define OBJBUF_MIN 8192 /* First allocation for a copy of unknown size */
+
+/* Default deadlines, in seconds */
+#define CONNECT_TIMEOUT 5
+#define HEADER_TIMEOUT 10
+#define IDLE_TIMEOUT 30
+#define TOTAL_TIMEOUT 120
+#define KEEPALIVE_TIMEOUT 5
+
+/* Proactive refresh of popular objects */
+#define REFRESH_BUDGET 4       /* Default origin refreshes per second */
+#define REFRESH_AHEAD_US 2000000L /* Refresh this long before expiry */
+#define REFRESH_MIN_RATE 0.5   /* Hits per second to count as popular */
+#define RATE_TAU_US 10000000.0 /* Decay time constant of hit rates */
+
+/* Hot-key tracking */
+#define HOTKEY_COUNTERS 128
+#define HOTKEY_TOPK 20
+
+/* Connection engines */
+#define ENGINE_THREADS 0 /* One blocking worker per connection */
+#define ENGINE_EPOLL 1   /* Edge-triggered epoll reactors (event.c) */
+#define ENGINE_URING 2   /* io_uring completion rings (uring.c) */
+
+/*
+ * Threads engine pipeline: the fast lane reads each request and answers
+ * hits, 304s and errors at once; only misses wait for the fetch pool,
+ * so a hit never queues behind a slow origin. Persistent connections
+ * waiting for their next request are parked in an epoll set rather
+ * than holding a worker.
+ */
+typedef struct
+{
+    wpool_t lane;  /* Reads requests, serves what the proxy can */
+    wpool_t fetch; /* Fetches misses from end servers */
+    twheel_t wheel; /* Deadlines of both stages */
+    int parkfd;     /* epoll set of idle persistent connections */
+} pipeline_t;
+
+/* A cache miss handed from the fast lane to the fetch pool */
+typedef struct
+{
+    char uri[MAXLINE], host[MAXLINE], port[MAXLINE];
+    char req[MAXBUF]; /* Request for the end server */
+    long start_us;    /* When the request started arriving */
+} fetch_t;
+
+/* A client connection, kept across the requests it sends */
+typedef struct
+{
+    rio_t rio;          /* Buffered client bytes, pipelined requests too */
+    fetch_t fetch;      /* The current request, when it is a miss */
+    twtimer_t deadline; /* Header or keep-alive deadline */
+    int keepalive;      /* Connection stays open after this response */
+    int http11;         /* Current request is HTTP/1.1 */
+    int parked;         /* Registered with the pipeline's parking set */
+} client_t;
+
+/* A response on its way from an end server to a client */
+typedef struct
+{
+    int connfd;        /* Client */
+    int serverfd;      /* End server */
+    rio_t srio;        /* Buffered reads from serverfd */
+    twheel_t *tw;      /* Wheel holding deadline */
+    twtimer_t deadline; /* Idle deadline on serverfd */
+    long start_us;     /* When the transaction started */
+    long fetch_start;  /* Fetch start, moved to exclude client writes */
+    objbuf_t obj;      /* Copy of the response for the cache */
+    long relayed;      /* Bytes passed to the client */
+    int broken;        /* The client stopped taking them */
+} relay_t;
+
+/* Each fetch worker's pipe for splicing uncacheable bodies */
+static pthread_key_t splice_key;
+static pthread_once_t splice_once = PTHREAD_ONCE_INIT;
+
+/* Per-core mode: one pinned engine per CPU, each on its own socket */
+#define MAX_CPUS 1024
+
+typedef struct
+{
+    int cpu;           /* CPU this core's threads are pinned to */
+    int listenfd;      /* SO_REUSEPORT socket private to this core */
+    int engine;        /* ENGINE_* run on this core */
+    pipeline_t pipe;   /* Workers (threads engine) */
+} core_t;
 
 /* You won't lose style points for including this long line in your code */
 static const char *user_agent_hdr =
     "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 "
     "Firefox/10.0.3\r\n";
 
+/* Cache eviction policies */
+#define EVICT_LRU 0  /* Least recently used */
+#define EVICT_COST 1 /* GreedyDual-Size weighted by fetch latency */
+
 /* Cache structure */
 typedef struct
 {
-    char buf[MAX_OBJECT_SIZE];
+    char *buf;       /* Response bytes, lz-compressed if raw_size != size */
     char url[MAXLINE];
-    int size;
+    char etag[VALIDATOR_LEN];          /* ETag of a cached 200, or "" */
+    char last_modified[VALIDATOR_LEN]; /* Last-Modified, or "" */
+    int size;        /* Bytes stored in buf */
+    int raw_size;    /* Bytes of the response as sent to clients */
     int valid;
     int timestamp;
+    long fetch_us;   /* Time spent fetching the object from the origin */
+    double priority; /* GreedyDual-Size value, evicted lowest first */
+    long expires_us; /* Freshness deadline (now_us clock), 0 if none */
+    double rate;     /* Decayed hit rate (hits/s) as of rate_us */
+    long rate_us;
 } cacheLine;
 
 typedef struct
@@ -30,265 +170,1963 @@ typedef struct
     cacheLine line[CACHE_LINE];
     int readcnt;
     int current_time;
-    sem_t mutex;  /* Protects readcnt */
-    sem_t writer; /* Protects cache writes */
+    int total_size;   /* Bytes held by valid lines */
+    int total_raw;    /* Same, before compression */
+    int compress;     /* Store compressible content types with lz */
+    double inflation; /* GreedyDual-Size aging value L */
+    int policy;       /* EVICT_LRU or EVICT_COST */
+    long refreshed;   /* Objects refetched before expiry */
+    long refresh_failed;
+    sem_t mutex;      /* Protects readcnt */
+    sem_t writer;     /* Protects cache writes */
+    sem_t meta;       /* Protects timestamps and priorities on hits */
 } cache_t;
 
 cache_t cache;
 
 /* Function prototypes */
-static void handle_client(int connfd);
-static int parse_uri(const char *uri, char *host, char *port, char *path);
-static void build_request(char *dst, size_t dstsz,
-                          const char *path, const char *host,
-                          rio_t *client_rio);
+static int serve_request(int connfd, client_t *c, twheel_t *tw);
+static void fetch_response(int connfd, client_t *c, twheel_t *tw);
+static int read_request_head(rio_t *rp, http_req_t *req);
+static int reqhdrs_value(const reqhdrs_t *rh, int i, char *val, size_t valsz);
+static int objbuf_reserve(objbuf_t *ob, int n);
 static void client_error(int fd, const char *cause, const char *errnum,
                          const char *shortmsg, const char *longmsg);
-void *thread(void *vargp);
+static void serve_stats(int fd, client_t *c, twheel_t *tw);
+static void client_send(int fd, client_t *c, twheel_t *tw, rio_iov_t *v);
+static int set_connection(client_t *c, char *msg, int len);
+static void lane_task(int connfd, void *arg);
+static void fetch_task(int connfd, void *arg);
+static void serve_threads(int listenfd, pipeline_t *pp);
+static void render_overload(void);
+static void clients_init(void);
+static void client_close(int connfd);
+static void client_next(pipeline_t *pp, int connfd);
+static void shed(int connfd);
+static void run_percore(char *port, int engine);
+void *refresher(void *vargp);
 
 /* Cache functions */
-void cache_init();
-int find_cache_hit(char *url);
-void write_cache(char *buf, char *url, int size);
-void read_cache(int idx, char *buf);
+void cache_init(int policy, int compress);
+static long freshness_lifetime(const char *buf, int size);
+
+pipeline_t pipeline;
+connpool_t upstreams;
+hotkey_t hotkeys;
+static int refresh_budget = REFRESH_BUDGET;
+static int min_threads = MIN_THREADS, max_threads = MAX_THREADS;
+timeouts_t timeouts = {CONNECT_TIMEOUT * 1000000L, HEADER_TIMEOUT * 1000000L,
+                       IDLE_TIMEOUT * 1000000L, TOTAL_TIMEOUT * 1000000L,
+                       KEEPALIVE_TIMEOUT * 1000000L};
+static int pool_per_origin = POOL_PER_ORIGIN, pool_max_idle = POOL_MAX_IDLE;
+static double pool_idle = POOL_IDLE_TIMEOUT;
+
+/* Reply to connections refused when every worker queue is full */
+static char *overload_resp;
+static size_t overload_len;
+
+/* Threads engine client connections, indexed by descriptor */
+static client_t **clients;
+
+/* Pipelines in use, for /stats */
+static pipeline_t *pipelines[MAX_CPUS];
+static int npipelines;
+
+/* Parse connect:header:idle:total[:keepalive] deadlines in seconds */
+static int parse_timeouts(const char *arg)
+{
+    double c, h, i, t, k = timeouts.keepalive_us / 1e6;
+    int n = sscanf(arg, "%lf:%lf:%lf:%lf:%lf", &c, &h, &i, &t, &k);
+
+    if (n < 4 || c <= 0 || h <= 0 || i <= 0 || t <= 0 || k <= 0)
+        return 0;
+    timeouts.connect_us = c * 1e6;
+    timeouts.header_us = h * 1e6;
+    timeouts.idle_us = i * 1e6;
+    timeouts.total_us = t * 1e6;
+    timeouts.keepalive_us = k * 1e6;
+    return 1;
+}
 
-sbuf_t sbuf;
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-e lru|cost] [-r refresh/s] [-z] "
+                    "[-m threads|epoll|uring] [-c] [-t min:max] "
+                    "[-T connect:header:idle:total[:keepalive]] "
+                    "[-P per-origin:max-idle:idle] <port>\n",
+            prog);
+    exit(1);
+}
 
 int main(int argc, char **argv)
 {
-    int listenfd, connfd;
-    socklen_t clientlen;
-    struct sockaddr_storage clientaddr;
+    int listenfd;
     pthread_t tid;
+    int opt, policy = EVICT_LRU, compress = 0, engine = ENGINE_THREADS;
+    int percore = 0;
 
-    if (argc != 2)
+    while ((opt = getopt(argc, argv, "e:r:zm:ct:T:P:")) != -1)
     {
-        fprintf(stderr, "usage: %s <port>\n", argv[0]);
-        exit(1);
+        switch (opt)
+        {
+        case 'e':
+            if (!strcmp(optarg, "lru"))
+                policy = EVICT_LRU;
+            else if (!strcmp(optarg, "cost"))
+                policy = EVICT_COST;
+            else
+                usage(argv[0]);
+            break;
+        case 'r':
+            refresh_budget = atoi(optarg);
+            break;
+        case 'z':
+            compress = 1;
+            break;
+        case 'T':
+            if (!parse_timeouts(optarg))
+                usage(argv[0]);
+            break;
+        case 'P':
+            if (sscanf(optarg, "%d:%d:%lf", &pool_per_origin, &pool_max_idle,
+                       &pool_idle) != 3 ||
+                pool_per_origin < 0 || pool_max_idle < 0 || pool_idle <= 0)
+                usage(argv[0]);
+            break;
+        case 't':
+            if (sscanf(optarg, "%d:%d", &min_threads, &max_threads) != 2 ||
+                min_threads < 1 || max_threads < min_threads)
+                usage(argv[0]);
+            break;
+        case 'm':
+            if (!strcmp(optarg, "threads"))
+                engine = ENGINE_THREADS;
+            else if (!strcmp(optarg, "epoll"))
+                engine = ENGINE_EPOLL;
+            else if (!strcmp(optarg, "uring"))
+                engine = ENGINE_URING;
+            else
+                usage(argv[0]);
+            break;
+        case 'c':
+            percore = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
     }
 
+    if (argc - optind != 1)
+        usage(argv[0]);
+
     printf("%s\n", user_agent_hdr);
-    listenfd = Open_listenfd(argv[1]);
-    sbuf_init(&sbuf, SBUFSIZE);
-    cache_init();
+
+    /* A client that resets its connection fails only writes to it */
+    Signal(SIGPIPE, SIG_IGN);
+    cache_init(policy, compress);
+    hotkey_init(&hotkeys, HOTKEY_COUNTERS);
+    render_overload();
+    if (engine == ENGINE_THREADS)
+    {
+        clients_init();
+        connpool_init(&upstreams, pool_per_origin, pool_max_idle,
+                      pool_idle * 1e6);
+    }
+    if (refresh_budget > 0)
+        Pthread_create(&tid, NULL, refresher, NULL);
+
+    if (percore)
+    {
+        run_percore(argv[optind], engine);
+        return 0;
+    }
+
+    listenfd = Open_listenfd(argv[optind]);
+
+    if (engine == ENGINE_EPOLL)
+    {
+        event_run(listenfd, 0);
+        return 0;
+    }
+    if (engine == ENGINE_URING)
+    {
+        uring_run(listenfd, 0);
+        return 0;
+    }
+
+    serve_threads(listenfd, &pipeline);
+    return 0;
+}
+
+/* Size the client table to the descriptor limit */
+static void clients_init(void)
+{
+    struct rlimit rl;
+    size_t n;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) < 0)
+        unix_error("getrlimit error");
+    n = rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > (1 << 20)
+            ? (1 << 20)
+            : rl.rlim_cur;
+    clients = Calloc(n, sizeof(client_t *));
+}
+
+/* Pre-render the 503 sent to connections the workers cannot take */
+static void render_overload(void)
+{
+    char hdr[MAXLINE], body[MAXBUF];
+    size_t hlen;
+
+    format_error(hdr, sizeof(hdr), body, sizeof(body), "503",
+                 "Service Unavailable", "Proxy is overloaded, retry later");
+    hlen = strlen(hdr) - 2; /* Drop the blank line ending the header */
+    snprintf(hdr + hlen, sizeof(hdr) - hlen, "Retry-After: %d\r\n\r\n",
+             SHED_RETRY_AFTER);
+
+    overload_len = strlen(hdr) + strlen(body);
+    overload_resp = Malloc(overload_len + 1);
+    strcpy(overload_resp, hdr);
+    strcat(overload_resp, body);
+}
+
+/*
+ * shed - turn connfd away with the pre-rendered 503. Never blocks: a
+ *     client whose socket buffer is full simply gets the close.
+ */
+static void shed(int connfd)
+{
+    char buf[MAXBUF];
+
+    send(connfd, overload_resp, overload_len, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+    /* Consume request bytes already here so close sends FIN, not RST */
+    shutdown(connfd, SHUT_WR);
+    while (recv(connfd, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+        ;
+    client_close(connfd);
+}
+
+/* Close connfd, forgetting its client state */
+static void client_close(int connfd)
+{
+    client_t *c = clients[connfd];
+
+    if (c)
+    {
+        clients[connfd] = NULL;
+        Free(c);
+    }
+    close(connfd);
+}
+
+/*
+ * park - hold the idle persistent connection connfd in the parking set
+ *     until its next request arrives, or until the keep-alive deadline
+ *     shuts it down
+ */
+static void park(pipeline_t *pp, int connfd)
+{
+    client_t *c = clients[connfd];
+    struct epoll_event ev;
+    int op = c->parked ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+
+    twheel_arm(&pp->wheel, &c->deadline, connfd, SHUT_RD,
+               timeouts.keepalive_us);
+    c->parked = 1;
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    ev.data.fd = connfd;
+    if (epoll_ctl(pp->parkfd, op, connfd, &ev) < 0)
+    {
+        twheel_cancel(&pp->wheel, &c->deadline);
+        client_close(connfd);
+    }
+}
+
+/* Hand parked connections back to the fast lane as they wake */
+static void *parker(void *vargp)
+{
+    pipeline_t *pp = vargp;
+    struct epoll_event evs[PARK_EVENTS];
+
+    Pthread_detach(pthread_self());
+    while (1)
+    {
+        int n = epoll_wait(pp->parkfd, evs, PARK_EVENTS, -1);
+
+        for (int i = 0; i < n; i++)
+        {
+            int connfd = evs[i].data.fd;
+
+            twheel_cancel(&pp->wheel, &clients[connfd]->deadline);
+            if (!wpool_trysubmit(&pp->lane, connfd))
+                shed(connfd);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * client_next - after a response on connfd, serve its next pipelined
+ *     request, park it until one arrives, or close it
+ */
+static void client_next(pipeline_t *pp, int connfd)
+{
+    client_t *c = clients[connfd];
+
+    if (!c->keepalive)
+        client_close(connfd);
+    else if (c->rio.rio_cnt > 0)
+    {
+        if (!wpool_trysubmit(&pp->lane, connfd))
+            shed(connfd);
+    }
+    else
+        park(pp, connfd);
+}
+
+/* Accept on listenfd and hand connections to the pipeline pp */
+static void serve_threads(int listenfd, pipeline_t *pp)
+{
+    int connfd;
+    socklen_t clientlen;
+    struct sockaddr_storage clientaddr;
+    pthread_t tid;
 
     /* Create worker threads */
-    for (int i = 0; i < NTHREADS; ++i)
-        Pthread_create(&tid, NULL, thread, NULL);
+    twheel_init(&pp->wheel, TIMEOUT_TICK_US);
+    if ((pp->parkfd = epoll_create1(0)) < 0)
+        unix_error("epoll_create1 error");
+    Pthread_create(&tid, NULL, parker, pp);
+    wpool_init(&pp->lane, LANE_MIN_THREADS, LANE_MAX_THREADS, SBUFSIZE,
+               lane_task, pp);
+    wpool_init(&pp->fetch, min_threads, max_threads, SBUFSIZE,
+               fetch_task, pp);
+    pipelines[__atomic_fetch_add(&npipelines, 1, __ATOMIC_RELAXED)] = pp;
 
     while (1)
     {
         clientlen = sizeof(struct sockaddr_storage);
-        connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen);
-        sbuf_insert(&sbuf, connfd);
+        if ((connfd = accept(listenfd, (SA *)&clientaddr, &clientlen)) < 0)
+        {
+            /*
+             * A client that gave up in the queue costs only itself; out
+             * of descriptors, wait for connections to close
+             */
+            if (errno != EINTR && errno != ECONNABORTED && errno != EPROTO)
+            {
+                perror("accept");
+                usleep(ACCEPT_BACKOFF_US);
+            }
+            continue;
+        }
+        if (!wpool_trysubmit(&pp->lane, connfd))
+            shed(connfd);
+    }
+}
+
+/*
+ * pin_cpu - restrict the calling thread to cpu. Threads it creates
+ *     afterwards inherit the restriction.
+ */
+static int pin_cpu(int cpu)
+{
+    unsigned long mask[MAX_CPUS / (8 * sizeof(long))];
+
+    memset(mask, 0, sizeof(mask));
+    mask[cpu / (8 * sizeof(long))] |= 1UL << (cpu % (8 * sizeof(long)));
+    return syscall(SYS_sched_setaffinity, 0, sizeof(mask), mask);
+}
+
+/* Run one core's engine on its own socket, pinned to its CPU */
+static void *core_thread(void *vargp)
+{
+    core_t *cp = vargp;
+
+    if (pin_cpu(cp->cpu) < 0)
+        fprintf(stderr, "pin to cpu %d: %s\n", cp->cpu, strerror(errno));
+
+    if (cp->engine == ENGINE_EPOLL)
+        event_serve(cp->listenfd);
+    else if (cp->engine == ENGINE_URING)
+        uring_serve(cp->listenfd);
+    else
+        serve_threads(cp->listenfd, &cp->pipe);
+    return NULL;
+}
+
+/*
+ * run_percore - one engine per CPU we may run on. Each has its own
+ *     SO_REUSEPORT socket, so the kernel spreads connections across
+ *     cores and accept, parsing and relaying stay on one core with no
+ *     shared accept queue. Only the cache is shared. Does not return.
+ */
+static void run_percore(char *port, int engine)
+{
+    unsigned long mask[MAX_CPUS / (8 * sizeof(long))];
+    core_t *cores;
+    pthread_t tid;
+    int ncores = 0;
+
+    memset(mask, 0, sizeof(mask));
+    if (syscall(SYS_sched_getaffinity, 0, sizeof(mask), mask) < 0)
+        unix_error("sched_getaffinity error");
+
+    if (engine == ENGINE_EPOLL)
+        event_init();
+    else if (engine == ENGINE_URING)
+        uring_init();
+
+    /* Open every socket before serving so all cores share the load */
+    if (posix_memalign((void **)&cores, MPMC_CACHE_LINE,
+                       MAX_CPUS * sizeof(core_t)) != 0)
+        app_error("posix_memalign error");
+    memset(cores, 0, MAX_CPUS * sizeof(core_t));
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++)
+    {
+        if (!(mask[cpu / (8 * sizeof(long))] &
+              (1UL << (cpu % (8 * sizeof(long))))))
+            continue;
+        cores[ncores].cpu = cpu;
+        cores[ncores].engine = engine;
+        cores[ncores].listenfd = Open_listenfd_reuseport(port);
+        ncores++;
+    }
+
+    for (int i = 1; i < ncores; i++)
+        Pthread_create(&tid, NULL, core_thread, &cores[i]);
+    core_thread(&cores[0]);
+}
+
+/*
+ * Fast-lane task: answer the requests waiting on connfd, in order, until
+ * one must go to the fetch pool or none is left
+ */
+static void lane_task(int connfd, void *arg)
+{
+    pipeline_t *pp = arg;
+    client_t *c = clients[connfd];
+    int one = 1;
+
+    if (!c)
+    {
+        /* New connection: its responses are written whole, so no Nagle */
+        c = clients[connfd] = Malloc(sizeof(client_t));
+        rio_readinitb(&c->rio, connfd);
+        twtimer_init(&c->deadline);
+        c->parked = 0;
+        setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    else if (c->deadline.expired)
+    {
+        client_close(connfd); /* Idle past the keep-alive deadline */
+        return;
+    }
+
+    do
+    {
+        if (serve_request(connfd, c, &pp->wheel) == REQ_FETCH)
+        {
+            if (!wpool_trysubmit(&pp->fetch, connfd))
+                shed(connfd);
+            return;
+        }
+    } while (c->keepalive && c->rio.rio_cnt > 0);
+    client_next(pp, connfd);
+}
+
+/* Fetch-pool task: relay the miss waiting on connfd */
+static void fetch_task(int connfd, void *arg)
+{
+    pipeline_t *pp = arg;
+
+    fetch_response(connfd, clients[connfd], &pp->wheel);
+    client_next(pp, connfd);
+}
+
+/* Initialize cache */
+void cache_init(int policy, int compress)
+{
+    cache.readcnt = 0;
+    cache.current_time = 0;
+    cache.total_size = 0;
+    cache.total_raw = 0;
+    cache.compress = compress;
+    cache.inflation = 0;
+    cache.policy = policy;
+    cache.refreshed = 0;
+    cache.refresh_failed = 0;
+    Sem_init(&cache.mutex, 0, 1);
+    Sem_init(&cache.writer, 0, 1);
+    Sem_init(&cache.meta, 0, 1);
+    for (int i = 0; i < CACHE_LINE; i++)
+    {
+        cache.line[i].buf = NULL;
+        cache.line[i].valid = 0;
+        cache.line[i].timestamp = 0;
+        cache.line[i].size = 0;
+        cache.line[i].etag[0] = '\0';
+        cache.line[i].last_modified[0] = '\0';
+    }
+}
+
+/* Find cache hit - returns index if found, -1 otherwise */
+int find_cache_hit(char *url)
+{
+    int ret = -1;
+    long now = now_us();
+    for (int i = 0; i < CACHE_LINE; i++)
+    {
+        if (cache.line[i].valid && !strcmp(cache.line[i].url, url) &&
+            (!cache.line[i].expires_us || now < cache.line[i].expires_us))
+        {
+            ret = i;
+            break;
+        }
+    }
+    return ret;
+}
+
+/* Enter the cache as a reader (first reader locks out writers) */
+static void cache_reader_lock(void)
+{
+    P(&cache.mutex);
+    cache.readcnt++;
+    if (cache.readcnt == 1)
+        P(&cache.writer);
+    V(&cache.mutex);
+}
+
+/* Leave the cache as a reader (last reader lets writers in) */
+static void cache_reader_unlock(void)
+{
+    P(&cache.mutex);
+    cache.readcnt--;
+    if (cache.readcnt == 0)
+        V(&cache.writer);
+    V(&cache.mutex);
+}
+
+/*
+ * GreedyDual-Size value of a line: objects that are slow to refetch per
+ * byte of cache they occupy stay longest. The inflation value L ages
+ * out entries that were expensive once but are no longer requested.
+ */
+static double cache_priority(cacheLine *cl)
+{
+    return cache.inflation + (double)(cl->fetch_us + 1) / cl->size;
+}
+
+/* Hit rate of line cl decayed to time now (caller holds cache.meta) */
+static double cache_rate(cacheLine *cl, long now)
+{
+    return cl->rate * exp(-(now - cl->rate_us) / RATE_TAU_US);
+}
+
+/* Record a hit on line cl (caller holds a reader or the writer lock) */
+static void cache_touch(cacheLine *cl)
+{
+    long now = now_us();
+
+    P(&cache.meta);
+    cl->timestamp = ++cache.current_time;
+    cl->priority = cache_priority(cl);
+    cl->rate = cache_rate(cl, now) + 1e6 / RATE_TAU_US;
+    cl->rate_us = now;
+    V(&cache.meta);
+}
+
+/*
+ * Read from cache with readers-writers protocol - returns object size,
+ * or -1 if line idx no longer holds url
+ */
+int read_cache(int idx, char *url, char *buf)
+{
+    int size = -1;
+
+    cache_reader_lock();
+
+    /* Critical section - reading */
+    if (cache.line[idx].valid && !strcmp(cache.line[idx].url, url))
+    {
+        cacheLine *cl = &cache.line[idx];
+        if (cl->raw_size != cl->size)
+            size = lz_decompress(cl->buf, cl->size, buf, MAX_OBJECT_SIZE);
+        else
+        {
+            size = cl->size;
+            memcpy(buf, cl->buf, size);
+        }
+        cache_touch(cl);
+    }
+
+    cache_reader_unlock();
+    return size;
+}
+
+/* Strip optional weak prefix and whitespace from an entity-tag */
+static const char *etag_opaque(const char *tag, size_t *len)
+{
+    while (*tag == ' ' || *tag == '\t')
+        tag++;
+    if (!strncmp(tag, "W/", 2))
+        tag += 2;
+    *len = strcspn(tag, ", \t");
+    return tag;
+}
+
+/* Weak comparison of an If-None-Match list against one entity-tag */
+static int etag_list_match(const char *list, const char *etag)
+{
+    size_t elen, tlen;
+    const char *e = etag_opaque(etag, &elen);
+
+    while (*list)
+    {
+        const char *t = etag_opaque(list, &tlen);
+        if ((tlen == 1 && *t == '*') ||
+            (tlen == elen && tlen > 0 && !strncmp(t, e, tlen)))
+            return 1;
+        list = t + tlen;
+        while (*list == ',' || *list == ' ' || *list == '\t')
+            list++;
+    }
+    return 0;
+}
+
+/* Parse an HTTP-date (IMF-fixdate) - returns -1 if malformed */
+static time_t parse_http_date(const char *s)
+{
+    static const char *months = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    char mon[4];
+    const char *m;
+    struct tm tm;
+
+    memset(&tm, 0, sizeof(tm));
+    if (sscanf(s, "%*3s, %d %3s %d %d:%d:%d GMT", &tm.tm_mday, mon,
+               &tm.tm_year, &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6)
+        return -1;
+    if (strlen(mon) != 3 || !(m = strstr(months, mon)) || (m - months) % 3)
+        return -1;
+    tm.tm_mon = (m - months) / 3;
+    tm.tm_year -= 1900;
+    return timegm(&tm);
+}
+
+/*
+ * Evaluate the client's validators against a cached entry. If the
+ * client's copy is still current, format a 304 header into hdr and
+ * return 1; otherwise return 0. If-None-Match takes precedence over
+ * If-Modified-Since (RFC 7232, section 6).
+ */
+int cache_not_modified(int idx, char *url, const reqhdrs_t *rh,
+                       char *hdr, size_t hdrsz)
+{
+    cacheLine *cl = &cache.line[idx];
+    char inm[MAXLINE], ims[MAXLINE];
+    int match = 0;
+
+    reqhdrs_value(rh, rh->if_none_match, inm, sizeof(inm));
+    reqhdrs_value(rh, rh->if_modified_since, ims, sizeof(ims));
+    if (!inm[0] && !ims[0])
+        return 0;
+
+    cache_reader_lock();
+
+    if (!cl->valid || strcmp(cl->url, url))
+        match = 0;
+    else if (inm[0])
+    {
+        match = cl->etag[0] && etag_list_match(inm, cl->etag);
+    }
+    else if (cl->last_modified[0])
+    {
+        time_t since = parse_http_date(ims);
+        time_t lm = parse_http_date(cl->last_modified);
+        if (since != -1 && lm != -1)
+            match = lm <= since;
+        else
+            match = !strcmp(ims, cl->last_modified);
+    }
+
+    if (match)
+    {
+        size_t n = snprintf(hdr, hdrsz, "HTTP/1.0 304 Not Modified\r\n");
+        if (cl->etag[0] && n < hdrsz)
+            n += snprintf(hdr + n, hdrsz - n, "ETag: %s\r\n", cl->etag);
+        if (cl->last_modified[0] && n < hdrsz)
+            n += snprintf(hdr + n, hdrsz - n, "Last-Modified: %s\r\n",
+                          cl->last_modified);
+        if (n < hdrsz)
+            snprintf(hdr + n, hdrsz - n, "\r\n");
+        cache_touch(cl);
+    }
+
+    cache_reader_unlock();
+    return match;
+}
+
+/* Drop line idx from the cache (caller holds the writer lock) */
+static void cache_evict(int idx)
+{
+    cacheLine *cl = &cache.line[idx];
+
+    cache.total_size -= cl->size;
+    cache.total_raw -= cl->raw_size;
+    Free(cl->buf);
+    cl->buf = NULL;
+    cl->size = 0;
+    cl->valid = 0;
+}
+
+/* Choose the line to evict under the current policy, -1 if empty */
+static int cache_victim(void)
+{
+    int idx = -1;
+
+    for (int i = 0; i < CACHE_LINE; i++)
+    {
+        cacheLine *cl = &cache.line[i];
+        if (!cl->valid)
+            continue;
+        if (idx == -1)
+            idx = i;
+        else if (cache.policy == EVICT_COST)
+        {
+            if (cl->priority < cache.line[idx].priority)
+                idx = i;
+        }
+        else if (cl->timestamp < cache.line[idx].timestamp)
+            idx = i;
+    }
+
+    if (idx != -1 && cache.policy == EVICT_COST)
+        cache.inflation = cache.line[idx].priority;
+    return idx;
+}
+
+/* Text content types that are worth compressing in the cache */
+static int compressible(const char *buf, int size)
+{
+    char ct[VALIDATOR_LEN];
+
+    if (get_header(buf, size, "Content-Encoding", ct, sizeof(ct)) ||
+        !get_header(buf, size, "Content-Type", ct, sizeof(ct)))
+        return 0;
+    for (char *p = ct; *p; p++)
+        *p = tolower((unsigned char)*p);
+    return !strncmp(ct, "text/", 5) || strstr(ct, "json") ||
+           strstr(ct, "javascript") || strstr(ct, "xml");
+}
+
+/*
+ * Write to cache, evicting until the object fits in MAX_CACHE_SIZE. The
+ * cache takes ownership of buf, which must come from Malloc.
+ */
+void write_cache(char *buf, char *url, int size, long fetch_us)
+{
+    long lifetime = freshness_lifetime(buf, size), now = now_us();
+    double rate = 0;
+    char *stored = buf;
+    int raw_size = size;
+
+    if (size > MAX_OBJECT_SIZE || lifetime == 0)
+    {
+        Free(buf);
+        return;
+    }
+
+    /* Compress outside the lock; keep it only if it saves 1/8 or more */
+    if (cache.compress && compressible(buf, size))
+    {
+        char *zbuf = Malloc(size);
+        int zsize = lz_compress(buf, size, zbuf, size - size / 8);
+        if (zsize > 0)
+        {
+            stored = zbuf;
+            size = zsize;
+        }
+        else
+            Free(zbuf);
+    }
+
+    P(&cache.writer);
+
+    int idx = -1;
+    /* Replace a stale copy of the same object, keeping its hit rate */
+    for (int i = 0; i < CACHE_LINE; i++)
+    {
+        if (cache.line[i].valid && !strcmp(cache.line[i].url, url))
+        {
+            rate = cache_rate(&cache.line[i], now);
+            cache_evict(i);
+        }
+    }
+
+    /* Evict until there is room for size bytes and a free line */
+    while (1)
+    {
+        if (cache.total_size + size <= MAX_CACHE_SIZE)
+        {
+            for (int i = 0; i < CACHE_LINE; i++)
+            {
+                if (cache.line[i].valid == 0)
+                {
+                    idx = i;
+                    break;
+                }
+            }
+            if (idx != -1)
+                break;
+        }
+        cache_evict(cache_victim());
+    }
+
+    /* Write to cache */
+    cacheLine *cl = &cache.line[idx];
+    cl->buf = stored;
+    strcpy(cl->url, url);
+    cl->size = size;
+    cl->raw_size = raw_size;
+    get_header(buf, raw_size, "ETag", cl->etag, VALIDATOR_LEN);
+    get_header(buf, raw_size, "Last-Modified", cl->last_modified,
+               VALIDATOR_LEN);
+    cl->fetch_us = fetch_us;
+    cl->timestamp = ++cache.current_time;
+    cl->priority = cache_priority(cl);
+    cl->expires_us = lifetime > 0 ? now + lifetime * 1000000L : 0;
+    cl->rate = rate;
+    cl->rate_us = now;
+    cl->valid = 1;
+    cache.total_size += size;
+    cache.total_raw += raw_size;
+
+    V(&cache.writer);
+    if (stored != buf)
+        Free(buf);
+}
+
+/*
+ * Freshness lifetime in seconds from Cache-Control (s-maxage, max-age)
+ * or Expires/Date. Returns 0 if the response must not be reused and -1
+ * if it carries no explicit lifetime.
+ */
+static long freshness_lifetime(const char *buf, int size)
+{
+    char cc[MAXLINE], val[VALIDATOR_LEN];
+    char *p;
+
+    if (get_header(buf, size, "Cache-Control", cc, sizeof(cc)))
+    {
+        for (p = cc; *p; p++)
+            *p = tolower((unsigned char)*p);
+        if (strstr(cc, "no-store") || strstr(cc, "no-cache") ||
+            strstr(cc, "private"))
+            return 0;
+        if ((p = strstr(cc, "s-maxage=")))
+            return atol(p + 9);
+        if ((p = strstr(cc, "max-age=")))
+            return atol(p + 8);
+    }
+
+    if (get_header(buf, size, "Expires", val, sizeof(val)))
+    {
+        time_t expires = parse_http_date(val), date = time(NULL);
+        if (expires == -1)
+            return 0; /* Invalid Expires means already expired */
+        if (get_header(buf, size, "Date", val, sizeof(val)) &&
+            parse_http_date(val) != -1)
+            date = parse_http_date(val);
+        return expires > date ? expires - date : 0;
+    }
+    return -1;
+}
+
+/*
+ * Fetch url from its origin and store it in the cache. Used off the
+ * request path, so every I/O failure is reported rather than fatal, and
+ * the fetch keeps to the same deadlines as a client's, kept on tw.
+ * Returns 0 on success, -1 on error.
+ */
+static int refresh_object(char *url, twheel_t *tw)
+{
+    char host[MAXLINE], port[MAXLINE], path[MAXLINE], req[MAXBUF];
+    char buf[MAXLINE], *obj;
+    objbuf_t ob;
+    rio_t rio;
+    twtimer_t deadline;
+    ssize_t n = -1;
+    int fd, size, rc = -1;
+    long start = now_us();
+
+    if (parse_uri(url, host, port, path) < 0)
+        return -1;
+
+    build_request(req, sizeof(req), path, host, NULL, 0);
+
+    fd = open_clientfd_timed(host, port,
+                             deadline_budget(start, timeouts.connect_us) / 1000);
+    if (fd < 0)
+        return -1;
+
+    /* Reading stops as soon as the head rules out caching */
+    objbuf_init(&ob);
+    rio_readinitb(&rio, fd);
+    twtimer_init(&deadline);
+    twheel_arm(tw, &deadline, fd, SHUT_RDWR,
+               deadline_budget(start, timeouts.idle_us));
+    if (rio_writen(fd, req, strlen(req)) >= 0)
+        while (ob.size <= MAX_OBJECT_SIZE &&
+               (n = rio_readnb(&rio, buf, sizeof(buf))) > 0)
+        {
+            objbuf_add(&ob, buf, n);
+            twheel_arm(tw, &deadline, fd, SHUT_RDWR,
+                       deadline_budget(start, timeouts.idle_us));
+        }
+    twheel_cancel(tw, &deadline);
+    /* An expired deadline ends the read early: never cache the part */
+    if (n == 0 && !deadline.expired && (obj = objbuf_take(&ob, &size)))
+    {
+        write_cache(obj, url, size, now_us() - start);
+        rc = 0;
+    }
+    objbuf_free(&ob);
+    close(fd);
+    return rc;
+}
+
+/* Order refresh candidates by decreasing hit rate */
+static int refresh_cmp(const void *a, const void *b)
+{
+    const double x = *(const double *)a, y = *(const double *)b;
+    return (x < y) - (x > y);
+}
+
+/*
+ * Refresher thread: once a second, refetch the most popular entries
+ * whose freshness deadline falls within REFRESH_AHEAD_US, at most
+ * refresh_budget of them, so hot keys never expire and origin load
+ * stays bounded.
+ */
+void *refresher(void *vargp)
+{
+    struct
+    {
+        double rate;
+        char url[MAXLINE];
+    } *cand;
+    int ncand, i;
+    twheel_t wheel;
+
+    Pthread_detach(pthread_self());
+    cand = Malloc(CACHE_LINE * sizeof(*cand));
+    twheel_init(&wheel, TIMEOUT_TICK_US);
+
+    while (1)
+    {
+        long tick = now_us(), now = tick;
+
+        ncand = 0;
+        cache_reader_lock();
+        P(&cache.meta);
+        for (i = 0; i < CACHE_LINE; i++)
+        {
+            cacheLine *cl = &cache.line[i];
+            double rate;
+
+            if (!cl->valid || !cl->expires_us ||
+                cl->expires_us - now > REFRESH_AHEAD_US)
+                continue;
+            if ((rate = cache_rate(cl, now)) < REFRESH_MIN_RATE)
+                continue;
+            cand[ncand].rate = rate;
+            strcpy(cand[ncand].url, cl->url);
+            ncand++;
+        }
+        V(&cache.meta);
+        cache_reader_unlock();
+
+        qsort(cand, ncand, sizeof(*cand), refresh_cmp);
+        for (i = 0; i < ncand && i < refresh_budget; i++)
+        {
+            int rc = refresh_object(cand[i].url, &wheel);
+            P(&cache.meta);
+            if (rc == 0)
+                cache.refreshed++;
+            else
+                cache.refresh_failed++;
+            V(&cache.meta);
+        }
+
+        now = now_us();
+        if (now - tick < 1000000L)
+            usleep(1000000L - (now - tick));
+    }
+    return NULL;
+}
+
+/* Monotonic clock in microseconds */
+long now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+/*
+ * serve_request - read the next request from the client c on connfd and
+ *     answer it if the proxy can by itself (error, stats, 304 or cache
+ *     hit), returning REQ_RESPOND. Otherwise fill in c->fetch and return
+ *     REQ_FETCH. The header must arrive within the header deadline, kept
+ *     on tw. c->keepalive tells whether the connection outlives the
+ *     response.
+ */
+static int serve_request(int connfd, client_t *c, twheel_t *tw)
+{
+    char buf[MAXLINE], path[MAXLINE];
+    fetch_t *f = &c->fetch;
+    char *uri = f->uri, *head;
+    http_req_t req;
+    reqhdrs_t rh;
+    int rc;
+
+    c->keepalive = 0;
+    f->start_us = now_us();
+    twheel_arm(tw, &c->deadline, connfd, SHUT_RD, timeouts.header_us);
+
+    /* A client that closed or reset the connection mid-head is gone */
+    rc = read_request_head(&c->rio, &req);
+    twheel_cancel(tw, &c->deadline);
+    if (c->deadline.expired)
+    {
+        client_error(connfd, "request", "408", "Request Timeout",
+                     "Proxy timed out waiting for the request");
+        return REQ_RESPOND;
+    }
+    if (rc == HTTP_MORE)
+        return REQ_RESPOND;
+    if (rc == HTTP_TOOBIG)
+    {
+        client_error(connfd, "request", "431",
+                     "Request Header Fields Too Large",
+                     "Proxy could not hold the request header");
+        return REQ_RESPOND;
+    }
+    if (rc == HTTP_BAD)
+    {
+        client_error(connfd, "bad request", "400", "Bad Request",
+                     "Proxy could not parse the request");
+        return REQ_RESPOND;
+    }
+
+    /*
+     * The head stays in place in rio's buffer, which is not read again
+     * until the next request
+     */
+    head = c->rio.rio_bufptr;
+    c->rio.rio_bufptr += req.len;
+    c->rio.rio_cnt -= req.len;
+
+    if (!http_is(head, req.method, "GET"))
+    {
+        snprintf(buf, sizeof(buf), "%.*s", req.method.len,
+                 head + req.method.off);
+        client_error(connfd, buf, "501", "Not Implemented",
+                     "Proxy does not implement this method");
+        return REQ_RESPOND;
+    }
+    if (req.uri.len >= MAXLINE)
+    {
+        client_error(connfd, "request", "414", "URI Too Long",
+                     "Proxy could not hold the URI");
+        return REQ_RESPOND;
+    }
+    memcpy(uri, head + req.uri.off, req.uri.len);
+    uri[req.uri.len] = '\0';
+    reqhdrs_init(&rh, head, &req);
+
+    /*
+     * A GET body is neither relayed nor skipped: left unread it would be
+     * taken for the next request on the connection, so the request is
+     * refused and the connection closed
+     */
+    if (rh.has_body)
+    {
+        client_error(connfd, "request", "400", "Bad Request",
+                     "Proxy does not accept a request body");
+        /* Take the body bytes already here so close sends FIN, not RST */
+        shutdown(connfd, SHUT_WR);
+        while (recv(connfd, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+            ;
+        return REQ_RESPOND;
+    }
+
+    /* HTTP/1.1 connections persist unless closed, 1.0 ones if asked to */
+    c->http11 = http_is(head, req.version, "HTTP/1.1");
+    c->keepalive = !rh.conn_close && (c->http11 || rh.conn_keepalive);
+
+    /* Requests addressed to the proxy itself */
+    if (!strcmp(uri, STATS_PATH))
+    {
+        serve_stats(connfd, c, tw);
+        return REQ_RESPOND;
+    }
+
+    /* Check cache first */
+    int cache_idx = find_cache_hit(uri);
+    if (cache_idx != -1)
+    {
+        if (cache_not_modified(cache_idx, uri, &rh, buf,
+                               sizeof(buf) - CONN_HDR_ROOM))
+        {
+            int n = set_connection(c, buf, strlen(buf));
+            rio_iov_t v;
+
+            rio_iovinit(&v);
+            rio_iovadd(&v, buf, n);
+            client_send(connfd, c, tw, &v);
+            hotkey_update(&hotkeys, uri, n);
+            return REQ_RESPOND;
+        }
+
+        char cached_response[MAX_OBJECT_SIZE + CONN_HDR_ROOM];
+        int cached_size = read_cache(cache_idx, uri, cached_response);
+        if (cached_size >= 0)
+        {
+            rio_iov_t v;
+
+            cached_size = set_connection(c, cached_response, cached_size);
+            rio_iovinit(&v);
+            rio_iovadd(&v, cached_response, cached_size);
+            client_send(connfd, c, tw, &v);
+            hotkey_update(&hotkeys, uri, cached_size);
+            return REQ_RESPOND;
+        }
+        /* Evicted since the lookup - fall through to a miss */
+    }
+
+    /* Parse URL */
+    if (parse_uri(uri, f->host, f->port, path) < 0)
+    {
+        c->keepalive = 0;
+        client_error(connfd, uri, "400", "Bad Request",
+                     "Proxy could not parse the URI");
+        return REQ_RESPOND;
+    }
+
+    /* Build outbound request */
+    build_request(f->req, sizeof(f->req), path, f->host, &rh,
+                  upstreams.per_origin > 0);
+    return REQ_FETCH;
+}
+
+/*
+ * deadline_budget - time allowed for a phase with budget phase_us of a
+ *     transaction that started at start_us, capped by the total deadline
+ */
+long deadline_budget(long start_us, long phase_us)
+{
+    long left = start_us + timeouts.total_us - now_us();
+
+    if (left < phase_us)
+        phase_us = left;
+    return phase_us > 0 ? phase_us : 1;
+}
+
+/*
+ * Send all of buf to an end server - returns -1 if it went away. On a
+ * persistent connection the kernel starts delaying ACKs to ride on our
+ * next request, which stalls an end server whose Nagle holds the rest
+ * of its response until the first segment is acknowledged; quick ACK
+ * mode is asked for again after every request.
+ */
+static int send_upstream(int fd, const char *buf, size_t n)
+{
+    int one = 1;
+
+    while (n > 0)
+    {
+        ssize_t rc = send(fd, buf, n, MSG_NOSIGNAL);
+
+        if (rc < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += rc;
+        n -= rc;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, &one, sizeof(one));
+    return 0;
+}
+
+/*
+ * The end server's idle deadline is suspended while the client takes
+ * response bytes, and the deadline watches the client instead: if it
+ * takes nothing for the idle time, or the transaction runs out of time,
+ * its write side is shut down and the write fails. relay_pause returns
+ * the fetch time so far, or -1 if the deadline had already expired;
+ * relay_resume rearms it on the end server after n bytes went out.
+ */
+static long relay_pause(relay_t *r)
+{
+    twheel_cancel(r->tw, &r->deadline); /* The client's pace is not idling */
+    if (r->deadline.expired)
+        return -1;
+    twheel_arm(r->tw, &r->deadline, r->connfd, SHUT_WR,
+               deadline_budget(r->start_us, timeouts.idle_us));
+    return now_us() - r->fetch_start;
+}
+
+static void relay_resume(relay_t *r, long fetch_us, size_t n)
+{
+    r->relayed += n;
+    r->fetch_start = now_us() - fetch_us; /* Exclude time spent on the client */
+    twheel_arm(r->tw, &r->deadline, r->serverfd, SHUT_RDWR,
+               deadline_budget(r->start_us, timeouts.idle_us));
+}
+
+/*
+ * Pass n response bytes to the client - returns -1 if the deadline
+ * expired or the client went away
+ */
+static int relay_write(relay_t *r, const char *buf, size_t n)
+{
+    long fetch_us = relay_pause(r);
+
+    if (fetch_us < 0)
+        return -1;
+    if (rio_writen(r->connfd, (void *)buf, n) < 0)
+    {
+        r->broken = 1;
+        return -1;
+    }
+    relay_resume(r, fetch_us, n);
+    return 0;
+}
+
+/*
+ * Pass the n-byte head at hdr to the client in one writev with the body
+ * bytes already buffered on r->srio, up to *len of them (all if *len is
+ * -1), keeping a copy of those for the cache; *len is reduced by them.
+ * Returns -1 if the deadline expired or the client went away.
+ */
+static int relay_head(relay_t *r, char *hdr, size_t n, long *len)
+{
+    long k = r->srio.rio_cnt, fetch_us = relay_pause(r);
+    rio_iov_t v;
+
+    if (fetch_us < 0)
+        return -1;
+    if (*len >= 0 && k > *len)
+        k = *len;
+    rio_iovinit(&v);
+    rio_iovadd(&v, hdr, n);
+    rio_iovadd(&v, r->srio.rio_bufptr, k);
+    if (rio_writev(r->connfd, &v) < 0)
+    {
+        r->broken = 1;
+        return -1;
+    }
+    relay_resume(r, fetch_us, n + k);
+
+    objbuf_add(&r->obj, r->srio.rio_bufptr, k);
+    r->srio.rio_bufptr += k;
+    r->srio.rio_cnt -= k;
+    if (*len > 0)
+        *len -= k;
+    return 0;
+}
+
+/* Pass n response bytes to the client, keeping a copy for the cache */
+static int relay_out(relay_t *r, const char *buf, size_t n)
+{
+    if (relay_write(r, buf, n) < 0)
+        return -1;
+    objbuf_add(&r->obj, buf, n);
+    return 0;
+}
+
+/* Relay the next len response bytes - returns -1 if they never came */
+static int relay_body(relay_t *r, long len)
+{
+    char buf[MAXLINE];
+
+    while (len > 0)
+    {
+        ssize_t n = rio_readnb(&r->srio, buf,
+                               len < (long)sizeof(buf) ? len : sizeof(buf));
+
+        if (n <= 0 || relay_out(r, buf, n) < 0)
+            return -1;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Relay a response delimited by the end server closing the connection */
+static void relay_until_eof(relay_t *r)
+{
+    char buf[MAXLINE];
+    ssize_t n;
+
+    while ((n = rio_readnb(&r->srio, buf, sizeof(buf))) > 0 &&
+           relay_out(r, buf, n) == 0)
+        ;
+}
+
+/* Close the pipe of a worker that exits, or whose pipe was left holding data */
+static void splice_pipe_free(void *vargp)
+{
+    int *fds = vargp;
+
+    close(fds[0]);
+    close(fds[1]);
+    Free(fds);
+}
+
+static void splice_key_init(void)
+{
+    pthread_key_create(&splice_key, splice_pipe_free);
+}
+
+/* This worker's pipe for splicing, created on first use */
+static int *splice_pipe(void)
+{
+    int *fds;
+
+    pthread_once(&splice_once, splice_key_init);
+    if ((fds = pthread_getspecific(splice_key)))
+        return fds;
+    fds = Malloc(2 * sizeof(int));
+    if (pipe(fds) < 0)
+    {
+        Free(fds);
+        return NULL;
+    }
+    pthread_setspecific(splice_key, fds);
+    return fds;
+}
+
+static ssize_t splice_fd(int in, int out, size_t n)
+{
+    ssize_t rc;
+
+    while ((rc = syscall(SYS_splice, in, NULL, out, NULL, n, SPLICE_F_MOVE)) < 0 &&
+           errno == EINTR)
+        ;
+    return rc;
+}
+
+/*
+ * Relay the next len response bytes, or all up to end of file if len is
+ * negative, without copying them through user space: what rio already
+ * buffered is written out, and the rest spliced from the end server's
+ * socket through this worker's pipe to the client's. Nothing is kept
+ * for the cache. Returns -1 if the bytes never came or the client did
+ * not take them.
+ */
+static int relay_splice(relay_t *r, long len)
+{
+    int *fds = splice_pipe();
+    size_t n = r->srio.rio_cnt;
+
+    if (len >= 0 && (long)n > len)
+        n = len;
+    if (n > 0)
+    {
+        if (relay_write(r, r->srio.rio_bufptr, n) < 0)
+            return -1;
+        r->srio.rio_bufptr += n;
+        r->srio.rio_cnt -= n;
+        len -= len >= 0 ? (long)n : 0;
+    }
+    if (!fds)
+    {
+        if (len >= 0)
+            return relay_body(r, len);
+        relay_until_eof(r);
+        return 0;
+    }
+
+    while (len != 0)
+    {
+        ssize_t in = splice_fd(r->serverfd, fds[1],
+                               len < 0 || len > SPLICE_CHUNK ? SPLICE_CHUNK : len);
+        long fetch_us;
+
+        if (in <= 0)
+            return in == 0 && len < 0 ? 0 : -1;
+        if ((fetch_us = relay_pause(r)) < 0)
+        {
+            pthread_setspecific(splice_key, NULL);
+            splice_pipe_free(fds);
+            return -1;
+        }
+        for (ssize_t left = in, out; left > 0; left -= out)
+        {
+            if ((out = splice_fd(fds[0], r->connfd, left)) <= 0)
+            {
+                r->broken = 1;
+                pthread_setspecific(splice_key, NULL);
+                splice_pipe_free(fds);
+                return -1;
+            }
+        }
+        relay_resume(r, fetch_us, in);
+        len -= len >= 0 ? in : 0;
+    }
+    return 0;
+}
+
+/*
+ * Read whatever the end server has sent on rp, at most n bytes, waiting
+ * only if nothing is buffered yet. Returns 0 at end of file.
+ */
+static ssize_t read_some(rio_t *rp, char *buf, size_t n)
+{
+    ssize_t rc;
+
+    if (rp->rio_cnt > 0)
+    {
+        rc = (size_t)rp->rio_cnt < n ? rp->rio_cnt : (ssize_t)n;
+        memcpy(buf, rp->rio_bufptr, rc);
+        rp->rio_bufptr += rc;
+        rp->rio_cnt -= rc;
+        return rc;
+    }
+    while ((rc = read(rp->rio_fd, buf, n)) < 0 && errno == EINTR)
+        ;
+    return rc;
+}
+
+/*
+ * Relay a chunked body, decoding it as it streams in. The cache keeps
+ * the plain data; the client gets it re-chunked if rechunk is set, as
+ * is otherwise. Extensions and trailer fields are dropped. Returns -1
+ * if the body is malformed, cut short or followed by stray bytes.
+ */
+static int relay_dechunked(relay_t *r, int rechunk)
+{
+    /* Room for a chunk-size line before the data, CRLF and last chunk after */
+    char buf[CHUNK_SIZE_ROOM + MAXLINE + 7];
+    char *data = buf + CHUNK_SIZE_ROOM;
+    chunked_t d;
+
+    chunked_init(&d);
+    while (d.state != CK_DONE)
+    {
+        ssize_t n = read_some(&r->srio, data, MAXLINE);
+        size_t used, m;
+        char *out = data, *tail;
+
+        if (n <= 0)
+            return -1;
+        m = chunked_decode(&d, data, n, &used);
+        if (d.state == CK_ERROR || used < (size_t)n)
+            return -1;
+        objbuf_add(&r->obj, data, m);
+
+        tail = data + m;
+        if (rechunk && m > 0)
+        {
+            char size[CHUNK_SIZE_ROOM];
+            int k = snprintf(size, sizeof(size), "%zx\r\n", m);
+
+            out -= k;
+            memcpy(out, size, k);
+            memcpy(tail, "\r\n", 2);
+            tail += 2;
+        }
+        if (rechunk && d.state == CK_DONE)
+        {
+            memcpy(tail, "0\r\n\r\n", 5);
+            tail += 5;
+        }
+        if (tail > out && relay_write(r, out, tail - out) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/*
+ * Read the status line and header block of the response on r->srio
+ * into hdr, skipping interim 1xx responses. Room is left to add a
+ * header line. Returns the block's length, or -1 if the end server
+ * closed, failed or did not speak HTTP.
+ */
+static int read_response_head(relay_t *r, char *hdr, size_t hdrsz,
+                              int *status)
+{
+    char *line;
+    ssize_t n;
+    size_t len;
+
+    do
+    {
+        len = 0;
+        do
+        {
+            /* Lines are copied once, from rio's buffer into hdr */
+            if ((n = rio_readlinep(&r->srio, &line)) <= 0 ||
+                len + n >= hdrsz - MAXLINE)
+                return -1;
+            memcpy(hdr + len, line, n);
+            len += n;
+        } while (!(n == 2 && line[0] == '\r' && line[1] == '\n') &&
+                 !(n == 1 && line[0] == '\n'));
+        hdr[len] = '\0';
+        if (sscanf(hdr, "HTTP/1.%*d %d", status) != 1)
+            return -1;
+    } while (*status >= 100 && *status < 200);
+    return len;
+}
+
+/*
+ * Is token one of the comma-separated elements of the header value val
+ * (len bytes)?
+ */
+static int value_has_token(const char *val, size_t len, const char *token)
+{
+    const char *end = val + len;
+    size_t toklen = strlen(token);
+
+    while (val < end)
+    {
+        const char *p;
+
+        while (val < end && strchr(", \t\r\n", *val))
+            val++;
+        for (p = val; p < end && !strchr(", \t\r\n", *p); p++)
+            ;
+        if ((size_t)(p - val) == toklen && !strncasecmp(val, token, toklen))
+            return 1;
+        val = p;
     }
     return 0;
 }
 
-void *thread(void *vargp)
+/* ... the same for a null-terminated value */
+static int header_has_token(const char *val, const char *token)
 {
-    Pthread_detach(pthread_self());
-    while (1)
-    {
-        int connfd = sbuf_remove(&sbuf);
-        handle_client(connfd);
-        Close(connfd);
-    }
+    return value_has_token(val, strlen(val), token);
 }
 
-/* Initialize cache */
-void cache_init()
+/*
+ * response_framing - how the end of the body of the response whose
+ *     head is hdr (len bytes, more may follow) is found: FRAME_*, with
+ *     the length in *clen for FRAME_LENGTH
+ */
+static int response_framing(const char *hdr, int len, long *clen)
 {
-    cache.readcnt = 0;
-    cache.current_time = 0;
-    Sem_init(&cache.mutex, 0, 1);
-    Sem_init(&cache.writer, 0, 1);
-    for (int i = 0; i < CACHE_LINE; i++)
-    {
-        cache.line[i].valid = 0;
-        cache.line[i].timestamp = 0;
-        cache.line[i].size = 0;
-    }
+    char val[MAXLINE], *end;
+    int status;
+
+    if (sscanf(hdr, "HTTP/1.%*d %d", &status) == 1 &&
+        ((status >= 100 && status < 200) || status == 204 || status == 304))
+        return FRAME_NONE;
+    if (get_header(hdr, len, "Transfer-Encoding", val, sizeof(val)) &&
+        header_has_token(val, "chunked"))
+        return FRAME_CHUNKED;
+    if (get_header(hdr, len, "Content-Length", val, sizeof(val)) &&
+        (*clen = strtol(val, &end, 10)) >= 0 && end != val && !*end)
+        return FRAME_LENGTH;
+    return FRAME_EOF;
 }
 
-/* Find cache hit - returns index if found, -1 otherwise */
-int find_cache_hit(char *url)
+/* What edit_head drops from a head */
+#define DROP_HOP 1 /* Hop-by-hop fields, and the fields Connection lists */
+#define DROP_TE 2  /* Transfer-Encoding */
+#define DROP_CL 4  /* Content-Length, which chunked framing overrides */
+
+/* Length of the header line at p, which ends before end */
+static size_t line_len(const char *p, const char *end)
 {
-    int ret = -1;
-    for (int i = 0; i < CACHE_LINE; i++)
-    {
-        if (cache.line[i].valid && !strcmp(cache.line[i].url, url))
-        {
-            ret = i;
-            break;
-        }
-    }
-    return ret;
+    const char *eol = memchr(p, '\n', end - p);
+
+    return eol ? eol + 1 - p : end - p;
 }
 
-/* Read from cache with readers-writers protocol */
-void read_cache(int idx, char *buf)
+/* Is the header line at p (n bytes) the blank line ending the head? */
+static int blank_line(const char *p, size_t n)
 {
-    P(&cache.mutex);
-    cache.readcnt++;
-    if (cache.readcnt == 1)
-        P(&cache.writer);
-    V(&cache.mutex);
-
-    /* Critical section - reading */
-    memcpy(buf, cache.line[idx].buf, cache.line[idx].size);
+    return n <= 2 && (*p == '\r' || *p == '\n');
+}
 
-    /* Update timestamp (use trywait to avoid blocking) */
-    if (sem_trywait(&cache.writer) == 0)
-    {
-        cache.line[idx].timestamp = ++cache.current_time;
-        V(&cache.writer);
-    }
+/*
+ * Classify the header line at p (n bytes): HF_*, with the length of its
+ * name in *k
+ */
+static int line_field(const char *p, size_t n, size_t *k)
+{
+    const char *colon = memchr(p, ':', n);
 
-    P(&cache.mutex);
-    cache.readcnt--;
-    if (cache.readcnt == 0)
-        V(&cache.writer);
-    V(&cache.mutex);
+    *k = colon ? colon - p : 0;
+    return http_field(p, *k);
 }
 
-/* Write to cache with LRU eviction */
-void write_cache(char *buf, char *url, int size)
+/*
+ * edit_head - drop header lines from the message msg of len bytes as
+ *     the DROP_* flags in drop say, and add the line add, if not NULL,
+ *     at the end of its head. The buffer must have room for it. Returns
+ *     the new length.
+ */
+static int edit_head(char *msg, int len, int drop, const char *add)
 {
-    if (size > MAX_OBJECT_SIZE)
-        return;
+    char *end = msg + len, *p, *out;
+    size_t addlen = add ? strlen(add) : 0, n, k;
+    http_listed_t listed;
+    int id;
 
-    P(&cache.writer);
+    /* The status line stays */
+    p = out = msg + line_len(msg, end);
 
-    int idx = -1;
-    /* Find empty slot */
-    for (int i = 0; i < CACHE_LINE; i++)
+    /* Connection may list fields that come before it */
+    listed.n = 0;
+    for (char *q = p; (drop & DROP_HOP) && q < end; q += n)
     {
-        if (cache.line[i].valid == 0)
-        {
-            idx = i;
+        if (blank_line(q, n = line_len(q, end)))
             break;
+        id = line_field(q, n, &k);
+        if (id == HF_CONNECTION || id == HF_PROXY_CONNECTION)
+        {
+            size_t v = k + 1, vend = n;
+
+            while (vend > v && (q[vend - 1] == '\n' || q[vend - 1] == '\r'))
+                vend--;
+            http_listed_add(&listed, q + v, vend - v);
         }
     }
 
-    /* LRU eviction if no empty slot */
-    if (idx == -1)
+    for (; p < end; p += n)
     {
-        int max_time = 0;
-        for (int i = 0; i < CACHE_LINE; i++)
-        {
-            if (cache.line[i].valid &&
-                cache.current_time - cache.line[i].timestamp > max_time)
-            {
-                max_time = cache.current_time - cache.line[i].timestamp;
-                idx = i;
-            }
-        }
+        if (blank_line(p, n = line_len(p, end)))
+            break;
+        id = line_field(p, n, &k);
+        if (((drop & DROP_HOP) &&
+             (HF_HOP_BY_HOP(id) || (k && http_listed(&listed, p, k)))) ||
+            ((drop & DROP_TE) && id == HF_TRANSFER_ENCODING) ||
+            ((drop & DROP_CL) && id == HF_CONTENT_LENGTH))
+            continue;
+        memmove(out, p, n);
+        out += n;
     }
+    memmove(out + addlen, p, end - p);
+    memcpy(out, add, addlen);
+    return out + addlen + (end - p) - msg;
+}
 
-    /* Write to cache */
-    memcpy(cache.line[idx].buf, buf, size);
-    strcpy(cache.line[idx].url, url);
-    cache.line[idx].size = size;
-    cache.line[idx].timestamp = ++cache.current_time;
-    cache.line[idx].valid = 1;
+/*
+ * set_connection - give the response msg of len bytes, whose buffer has
+ *     CONN_HDR_ROOM bytes to spare, a Connection header telling whether
+ *     the connection to the client c stays open. It does if the client
+ *     asked for that and can find the end of the response without the
+ *     connection closing. Returns the new length.
+ */
+static int set_connection(client_t *c, char *msg, int len)
+{
+    long clen;
+    int framing = response_framing(msg, len, &clen);
 
-    V(&cache.writer);
+    if (framing == FRAME_EOF || (framing == FRAME_CHUNKED && !c->http11))
+        c->keepalive = 0;
+    return edit_head(msg, len, DROP_HOP,
+                     c->keepalive ? "Connection: keep-alive\r\n"
+                                  : "Connection: close\r\n");
 }
 
-/* Handle a single HTTP transaction with caching */
-static void handle_client(int connfd)
+/*
+ * fetch_response - relay the miss of client c from its end server to
+ *     connfd. The upstream connection comes from the pool when one to
+ *     the origin is idle, and goes back to it if the response, delimited
+ *     by its Content-Length or chunked framing, leaves it reusable. The
+ *     connect, each wait for response bytes and the whole transaction
+ *     have deadlines, kept on tw; a response that never started is
+ *     answered with a 504.
+ */
+static void fetch_response(int connfd, client_t *c, twheel_t *tw)
 {
-    rio_t crio, srio;
-    char buf[MAXLINE];
-    char method[MAXLINE], uri[MAXLINE], version[MAXLINE];
-    char host[MAXLINE], port[MAXLINE], path[MAXLINE];
-    char cache_buf[MAX_OBJECT_SIZE];
-    int object_size = 0;
+    relay_t r;
+    fetch_t *f = &c->fetch;
+    char hdr[RESP_HDR_MAX], val[MAXLINE];
+    char *obj;
+    int len = -1, status, rc = 0, keep, framing, cache_head, size;
+    int keepalive = c->keepalive;
+    long clen, body;
+    char *uri = f->uri;
 
-    Rio_readinitb(&crio, connfd);
+    c->keepalive = 0; /* Unless a complete response is relayed */
+    r.connfd = connfd;
+    r.tw = tw;
+    r.start_us = f->start_us;
+    r.fetch_start = now_us(); /* Timing every origin round trip */
+    objbuf_init(&r.obj);
+    r.relayed = 0;
+    r.broken = 0;
+    twtimer_init(&r.deadline);
 
-    /* Read request line */
-    if (Rio_readlineb(&crio, buf, MAXLINE) <= 0)
-        return;
-
-    if (sscanf(buf, "%s %s %s", method, uri, version) != 3)
+    /*
+     * A pooled connection may have been closed by the end server just as
+     * the request went out; GET is idempotent, so that case is retried
+     * once on a fresh connection.
+     */
+    int reused = (r.serverfd = connpool_get(&upstreams, f->host, f->port)) >= 0;
+    while (len < 0)
     {
-        client_error(connfd, "bad request line", "400", "Bad Request",
-                     "Proxy could not parse the request line");
-        return;
-    }
+        if (!reused)
+        {
+            r.serverfd = open_clientfd_timed(
+                f->host, f->port,
+                deadline_budget(f->start_us, timeouts.connect_us) / 1000);
+            if (r.serverfd < 0)
+            {
+                if (r.serverfd == -1 && errno == ETIMEDOUT)
+                    client_error(connfd, f->host, "504", "Gateway Timeout",
+                                 "End server did not accept the connection in time");
+                else
+                    client_error(connfd, f->host, "502", "Bad Gateway",
+                                 "Proxy could not connect to end server");
+                return;
+            }
+        }
 
-    if (strcasecmp(method, "GET"))
-    {
-        client_error(connfd, method, "501", "Not Implemented",
-                     "Proxy does not implement this method");
-        return;
+        rio_readinitb(&r.srio, r.serverfd);
+        twheel_arm(tw, &r.deadline, r.serverfd, SHUT_RDWR,
+                   deadline_budget(f->start_us, timeouts.idle_us));
+        if (send_upstream(r.serverfd, f->req, strlen(f->req)) == 0 &&
+            (len = read_response_head(&r, hdr, sizeof(hdr), &status)) >= 0)
+            break;
+
+        twheel_cancel(tw, &r.deadline);
+        close(r.serverfd);
+        if (r.deadline.expired)
+        {
+            client_error(connfd, f->host, "504", "Gateway Timeout",
+                         "End server did not respond in time");
+            return;
+        }
+        if (!reused)
+        {
+            client_error(connfd, f->host, "502", "Bad Gateway",
+                         "Proxy could not read a response from end server");
+            return;
+        }
+        reused = 0;
     }
 
-    /* Check cache first */
-    int cache_idx = find_cache_hit(uri);
-    if (cache_idx != -1)
+    /* The connection survives only a complete, delimited HTTP/1.1 reply */
+    framing = response_framing(hdr, len, &clen);
+    keep = !strncmp(hdr, "HTTP/1.1", 8) && framing != FRAME_EOF &&
+           !(get_header(hdr, len, "Connection", val, sizeof(val)) &&
+             header_has_token(val, "close"));
+
+    /*
+     * The cache keeps the head without the hop's connection headers; the
+     * head alone decides whether, and in how big a buffer, the body is
+     * kept. A chunked body is decoded for the cache, and for an HTTP/1.0
+     * client, which cannot parse chunks; the copy sent to an HTTP/1.1
+     * client is re-chunked. A Content-Length sent along with chunked
+     * framing is wrong, so it goes from every copy (RFC 9112, 6.3).
+     */
+    len = edit_head(hdr, len, DROP_HOP, NULL);
+    if (framing == FRAME_CHUNKED)
+        len = edit_head(hdr, len, c->http11 ? DROP_CL : DROP_TE | DROP_CL,
+                        NULL);
+    objbuf_add(&r.obj, hdr, len);
+    if (framing == FRAME_CHUNKED && r.obj.buf)
+        r.obj.size = edit_head(r.obj.buf, r.obj.size, DROP_TE, NULL);
+    cache_head = r.obj.size;
+    c->keepalive = keepalive;
+    len = set_connection(c, hdr, len);
+
+    /*
+     * Relay response and accumulate for caching. The head leaves with
+     * the body bytes that came with it, so a small response is a single
+     * write even though the socket has Nagle off.
+     */
+    body = framing == FRAME_LENGTH ? clen : framing == FRAME_EOF ? -1 : 0;
+    if (relay_head(&r, hdr, len, &body) < 0)
+        rc = -1;
+    else if (framing == FRAME_CHUNKED)
+        rc = relay_dechunked(&r, c->http11);
+    else if (!r.obj.buf && framing != FRAME_NONE)
+        rc = relay_splice(&r, body);
+    else if (framing == FRAME_LENGTH)
+        rc = relay_body(&r, body);
+    else if (framing == FRAME_EOF)
+        relay_until_eof(&r);
+
+    twheel_cancel(tw, &r.deadline);
+    if (r.deadline.expired || rc < 0)
     {
-        char cached_response[MAX_OBJECT_SIZE];
-        read_cache(cache_idx, cached_response);
-        Rio_writen(connfd, cached_response, cache.line[cache_idx].size);
+        /*
+         * Truncated: never cache it, and say why if nothing was sent to
+         * a client still there
+         */
+        c->keepalive = 0;
+        if (r.relayed == 0 && !r.broken)
+            client_error(connfd, f->host, "504", "Gateway Timeout",
+                         "End server did not respond in time");
+        objbuf_free(&r.obj);
+        close(r.serverfd);
         return;
     }
 
-    /* Parse URL */
-    if (parse_uri(uri, host, port, path) < 0)
+    /* The decoded copy is delimited by a Content-Length instead */
+    if (framing == FRAME_CHUNKED && r.obj.buf)
     {
-        client_error(connfd, uri, "400", "Bad Request",
-                     "Proxy could not parse the URI");
-        return;
+        char line[MAXLINE];
+        int n = snprintf(line, sizeof(line), "Content-Length: %d\r\n",
+                         r.obj.size - cache_head);
+
+        if (objbuf_reserve(&r.obj, r.obj.size + n) == 0)
+            r.obj.size = edit_head(r.obj.buf, r.obj.size, 0, line);
     }
 
-    /* Build outbound request */
-    char outreq[MAXBUF];
-    build_request(outreq, sizeof(outreq), path, host, &crio);
+    /* Cache the object if all of it was kept */
+    if ((obj = objbuf_take(&r.obj, &size)))
+        write_cache(obj, uri, size, now_us() - r.fetch_start);
+
+    hotkey_update(&hotkeys, uri, r.relayed);
+    if (keep && r.srio.rio_cnt == 0)
+        connpool_put(&upstreams, f->host, f->port, r.serverfd);
+    else
+        close(r.serverfd);
+}
+
+/*
+ * Only 200 responses are cached: a 304 answering a forwarded conditional
+ * request must not be served to later unconditional requests.
+ */
+int cacheable_response(const char *buf, int size)
+{
+    return size > 12 && !strncmp(buf, "HTTP/1.", 7) &&
+           !strncmp(buf + 8, " 200", 4);
+}
 
-    /* Connect to end server */
-    int serverfd = Open_clientfd(host, port);
-    if (serverfd < 0)
+/*
+ * What to keep for the cache of the response whose complete head is the
+ * len bytes at head: CACHE_SKIP, CACHE_GROW, or the size the object's
+ * Content-Length announces
+ */
+static int cache_plan(const char *head, int len)
+{
+    long clen;
+
+    if (!cacheable_response(head, len) || freshness_lifetime(head, len) == 0)
+        return CACHE_SKIP;
+    if (response_framing(head, len, &clen) != FRAME_LENGTH)
+        return CACHE_GROW;
+    return clen <= MAX_OBJECT_SIZE - len ? len + clen : CACHE_SKIP;
+}
+
+/* Length of the head that starts the n bytes at buf, 0 if it goes on */
+static int head_length(const char *buf, int n)
+{
+    const char *p = buf, *end = buf + n, *nl;
+
+    while ((nl = memchr(p, '\n', end - p)))
     {
-        client_error(connfd, host, "502", "Bad Gateway",
-                     "Proxy could not connect to end server");
-        return;
+        if (nl == p || (nl == p + 1 && *p == '\r'))
+            return nl + 1 - buf;
+        p = nl + 1;
     }
+    return 0;
+}
 
-    Rio_readinitb(&srio, serverfd);
-    Rio_writen(serverfd, outreq, strlen(outreq));
+void objbuf_init(objbuf_t *ob)
+{
+    memset(ob, 0, sizeof(*ob));
+}
 
-    /* Relay response and accumulate for caching */
-    ssize_t n;
-    while ((n = Rio_readnb(&srio, buf, sizeof(buf))) > 0)
-    {
-        Rio_writen(connfd, buf, n);
+/* Stop keeping ob: nothing more is copied, and it is never cached */
+void objbuf_free(objbuf_t *ob)
+{
+    Free(ob->buf);
+    ob->buf = NULL;
+    ob->cap = 0;
+    ob->size = MAX_OBJECT_SIZE + 1;
+}
 
-        /* Accumulate in cache buffer if within size limit */
-        if (object_size + n <= MAX_OBJECT_SIZE)
-        {
-            memcpy(cache_buf + object_size, buf, n);
-            object_size += n;
-        }
-        else
-        {
-            object_size = MAX_OBJECT_SIZE + 1; /* Mark as too large */
-        }
+/*
+ * Make room for n bytes in all at ob->buf. A copy of unknown size grows
+ * by doubling up to MAX_OBJECT_SIZE. Returns -1, dropping the copy, if
+ * n bytes are more than it may hold.
+ */
+static int objbuf_reserve(objbuf_t *ob, int n)
+{
+    int cap;
+
+    if (ob->size > MAX_OBJECT_SIZE)
+        return -1;
+    if (n <= ob->cap)
+        return 0;
+    if (n > MAX_OBJECT_SIZE || ob->exact)
+    {
+        objbuf_free(ob);
+        return -1;
     }
+    cap = ob->cap < OBJBUF_MIN ? OBJBUF_MIN : 2 * ob->cap;
+    if (cap < n)
+        cap = n;
+    if (cap > MAX_OBJECT_SIZE)
+        cap = MAX_OBJECT_SIZE;
+    ob->buf = Realloc(ob->buf, cap);
+    ob->cap = cap;
+    return 0;
+}
+
+/*
+ * objbuf_add - copy the next n response bytes into ob. Once the head is
+ *     complete it is planned: the copy is dropped if the response cannot
+ *     be cached, or sized to its Content-Length, past which it is
+ *     dropped too.
+ */
+void objbuf_add(objbuf_t *ob, const char *data, int n)
+{
+    int plan;
+
+    if (objbuf_reserve(ob, ob->size + n) < 0)
+        return;
+    memcpy(ob->buf + ob->size, data, n);
+    ob->size += n;
+    if (ob->head > 0 || (ob->head = head_length(ob->buf, ob->size)) == 0)
+        return;
 
-    /* Cache the object if it's within size limit */
-    if (object_size > 0 && object_size <= MAX_OBJECT_SIZE)
+    plan = cache_plan(ob->buf, ob->head);
+    if (plan == CACHE_SKIP || (plan > 0 && ob->size > plan))
+        objbuf_free(ob);
+    else if (plan > 0)
     {
-        write_cache(cache_buf, uri, object_size);
+        ob->buf = Realloc(ob->buf, plan);
+        ob->cap = plan;
+        ob->exact = 1;
     }
+}
+
+/*
+ * objbuf_take - hand over the copy in ob, trimmed to its size in *size,
+ *     if it holds a whole cacheable response; the caller then owns it.
+ *     Returns NULL otherwise.
+ */
+char *objbuf_take(objbuf_t *ob, int *size)
+{
+    char *buf = ob->buf;
 
-    Close(serverfd);
+    if (!buf || ob->head == 0 || (ob->exact && ob->size != ob->cap))
+        return NULL;
+    if (ob->size < ob->cap)
+        buf = Realloc(buf, ob->size);
+    *size = ob->size;
+    ob->buf = NULL;
+    objbuf_free(ob);
+    return buf;
 }
 
 /* Parse URI */
-static int parse_uri(const char *uri, char *host, char *port, char *path)
+int parse_uri(const char *uri, char *host, char *port, char *path)
 {
     const char *u = uri;
     const char *p;
@@ -340,54 +2178,142 @@ static int parse_uri(const char *uri, char *host, char *port, char *path)
     return 0;
 }
 
-/* Build HTTP/1.0 request */
-static void build_request(char *dst, size_t dstsz,
-                          const char *path, const char *host,
-                          rio_t *client_rio)
+/*
+ * reqhdrs_init - classify the header fields of the request head parsed
+ *     into req, noting its validators and connection options, and which
+ *     fields go on to the end server: not the hop-by-hop ones, nor those
+ *     Connection lists, nor Host and User-Agent, which the proxy supplies
+ */
+void reqhdrs_init(reqhdrs_t *rh, const char *head, const http_req_t *req)
 {
-    size_t nused = 0;
-    char line[MAXLINE];
-
-    nused += snprintf(dst + nused, dstsz - nused,
-                      "GET %s HTTP/1.0\r\n", path);
-
-    char other[MAXBUF];
-    size_t other_used = 0;
+    http_listed_t listed;
 
-    while (Rio_readlineb(client_rio, line, sizeof(line)) > 0)
+    rh->head = head;
+    rh->req = req;
+    rh->if_none_match = rh->if_modified_since = -1;
+    rh->conn_close = rh->conn_keepalive = rh->has_body = 0;
+    rh->forward = 0;
+    listed.n = 0;
+    for (int i = 0; i < req->nfields; i++)
     {
-        if (!strcmp(line, "\r\n"))
-            break;
-
-        if (!strncasecmp(line, "Host:", 5))
-            continue;
-        if (!strncasecmp(line, "User-Agent:", 11))
-            continue;
-        if (!strncasecmp(line, "Connection:", 11))
-            continue;
-        if (!strncasecmp(line, "Proxy-Connection:", 17))
-            continue;
+        const hfield_t *f = &req->fields[i];
+        const char *val = head + f->value.off;
 
-        if (other_used + strlen(line) < sizeof(other))
+        switch (http_field(head + f->name.off, f->name.len))
         {
-            memcpy(other + other_used, line, strlen(line));
-            other_used += strlen(line);
+        case HF_OTHER:
+            rh->forward |= 1ULL << i;
+            break;
+        case HF_IF_NONE_MATCH:
+            if (rh->if_none_match < 0)
+                rh->if_none_match = i;
+            rh->forward |= 1ULL << i;
+            break;
+        case HF_IF_MODIFIED_SINCE:
+            if (rh->if_modified_since < 0)
+                rh->if_modified_since = i;
+            rh->forward |= 1ULL << i;
+            break;
+        case HF_CONNECTION:
+        case HF_PROXY_CONNECTION:
+            rh->conn_close |= value_has_token(val, f->value.len, "close");
+            rh->conn_keepalive |= value_has_token(val, f->value.len,
+                                                  "keep-alive");
+            http_listed_add(&listed, val, f->value.len);
+            break;
+        case HF_CONTENT_LENGTH:
+            /* The body is not relayed, so neither is its framing */
+            if (f->value.len == 0 ||
+                strspn(val, "0") < (size_t)f->value.len)
+                rh->has_body = 1;
+            break;
+        case HF_TRANSFER_ENCODING:
+            rh->has_body = 1;
+            break;
         }
     }
-    other[other_used] = '\0';
+
+    /* The fields Connection lists may come before it */
+    for (int i = 0; listed.n && i < req->nfields; i++)
+        if (http_listed(&listed, head + req->fields[i].name.off,
+                        req->fields[i].name.len))
+            rh->forward &= ~(1ULL << i);
+}
+
+/* Copy the value of rh's field i into val - returns 0 if i is -1 */
+static int reqhdrs_value(const reqhdrs_t *rh, int i, char *val, size_t valsz)
+{
+    hview_t v;
+
+    val[0] = '\0';
+    if (i < 0)
+        return 0;
+    v = rh->req->fields[i].value;
+    if ((size_t)v.len >= valsz)
+        v.len = valsz - 1;
+    memcpy(val, rh->head + v.off, v.len);
+    val[v.len] = '\0';
+    return 1;
+}
+
+/*
+ * Read the client's request head into rp's buffer, parsing it in place
+ * as it arrives. Returns HTTP_DONE with the head (req->len bytes) left
+ * unread at rio_bufptr, HTTP_BAD or HTTP_TOOBIG, or HTTP_MORE if the
+ * client closed or failed before finishing it. A head must fit in the
+ * buffer.
+ */
+static int read_request_head(rio_t *rp, http_req_t *req)
+{
+    int rc;
+
+    http_init(req);
+    while ((rc = http_parse(req, rp->rio_bufptr,
+                            rp->rio_cnt > 0 ? rp->rio_cnt : 0)) == HTTP_MORE)
+    {
+        if (rp->rio_cnt == RIO_BUFSIZE)
+            return HTTP_TOOBIG;
+        if (rio_fillb(rp) <= 0)
+            return HTTP_MORE;
+    }
+    return rc;
+}
+
+/*
+ * Build the request for the end server: HTTP/1.1 on a connection that
+ * may be kept alive for later requests, otherwise HTTP/1.0 on one the
+ * end server closes after its response. The client's forwarded header
+ * lines, if rh is not NULL, are copied straight from its request head.
+ */
+void build_request(char *dst, size_t dstsz,
+                          const char *path, const char *host,
+                          const reqhdrs_t *rh, int keepalive)
+{
+    size_t nused = 0;
+
+    nused += snprintf(dst + nused, dstsz - nused,
+                      "GET %s HTTP/1.%d\r\n", path, keepalive ? 1 : 0);
 
     nused += snprintf(dst + nused, dstsz - nused,
                       "Host: %s\r\n", host);
     nused += snprintf(dst + nused, dstsz - nused, "%s", user_agent_hdr);
-    nused += snprintf(dst + nused, dstsz - nused,
-                      "Connection: close\r\n");
-    nused += snprintf(dst + nused, dstsz - nused,
-                      "Proxy-Connection: close\r\n");
+    if (!keepalive)
+    {
+        nused += snprintf(dst + nused, dstsz - nused,
+                          "Connection: close\r\n");
+        nused += snprintf(dst + nused, dstsz - nused,
+                          "Proxy-Connection: close\r\n");
+    }
 
-    if (other_used && nused + other_used < dstsz)
+    for (int i = 0; rh && i < rh->req->nfields; i++)
     {
-        memcpy(dst + nused, other, other_used);
-        nused += other_used;
+        hview_t line = rh->req->fields[i].line;
+
+        if ((rh->forward >> i & 1) && nused + line.len < dstsz)
+        {
+            memcpy(dst + nused, rh->head + line.off, line.len);
+            nused += line.len;
+        }
     }
 
     if (nused + 2 < dstsz)
@@ -398,13 +2324,126 @@ static void build_request(char *dst, size_t dstsz,
     dst[nused] = '\0';
 }
 
-/* Send HTTP error to client */
-static void client_error(int fd, const char *cause, const char *errnum,
-                         const char *shortmsg, const char *longmsg)
+/*
+ * Find header <name> in the header block of an HTTP message of size
+ * bytes and copy its trimmed value into val. Returns 1 if found.
+ */
+int get_header(const char *msg, int size, const char *name,
+               char *val, size_t valsz)
 {
-    char body[MAXBUF], hdr[MAXBUF];
+    const char *p = msg, *end = msg + size;
+    size_t namelen = strlen(name);
+
+    val[0] = '\0';
+    while (p < end)
+    {
+        const char *eol = memchr(p, '\n', end - p);
+        if (!eol)
+            eol = end;
+        if (eol - p <= 2 && (*p == '\r' || *p == '\n'))
+            break; /* End of headers */
+
+        if (eol - p > namelen && !strncasecmp(p, name, namelen) &&
+            p[namelen] == ':')
+        {
+            const char *v = p + namelen + 1;
+            const char *vend = eol;
+            while (v < vend && (*v == ' ' || *v == '\t'))
+                v++;
+            while (vend > v && isspace((unsigned char)vend[-1]))
+                vend--;
+            size_t n = vend - v;
+            if (n >= valsz)
+                n = valsz - 1;
+            memcpy(val, v, n);
+            val[n] = '\0';
+            return 1;
+        }
+        p = eol + 1;
+    }
+    return 0;
+}
+
+/* Length of n report bytes once cut, as snprintf cuts them, to bufsz */
+static size_t report_fit(size_t n, size_t bufsz)
+{
+    return n < bufsz ? n : bufsz - 1;
+}
+
+/*
+ * Format the proxy's statistics report into body - returns its length.
+ * Every part is cut to the room left, so a long report is truncated.
+ */
+int format_stats(char *body, size_t bodysz)
+{
+    size_t n;
+
+    P(&cache.meta);
+    n = snprintf(body, bodysz,
+                 "cache: %d bytes (%d uncompressed), %s eviction\n"
+                 "refresh: %ld refreshed, %ld failed, budget %d/s\n",
+                 cache.total_size, cache.total_raw,
+                 cache.policy == EVICT_COST ? "cost" : "lru",
+                 cache.refreshed, cache.refresh_failed, refresh_budget);
+    V(&cache.meta);
+    n = report_fit(n, bodysz);
+    for (int i = 0; i < __atomic_load_n(&npipelines, __ATOMIC_RELAXED); i++)
+    {
+        if (!pipelines[i])
+            continue;
+        n = report_fit(n + snprintf(body + n, bodysz - n, "lane "), bodysz);
+        n += wpool_report(&pipelines[i]->lane, body + n, bodysz - n);
+        n = report_fit(n + snprintf(body + n, bodysz - n, "fetch "), bodysz);
+        n += wpool_report(&pipelines[i]->fetch, body + n, bodysz - n);
+    }
+    if (npipelines > 0)
+        n += connpool_report(&upstreams, body + n, bodysz - n);
+    n += hotkey_report(&hotkeys, HOTKEY_TOPK, body + n, bodysz - n);
+    return n;
+}
+
+/*
+ * client_send - write a response the proxy holds to client c on fd. If
+ *     the client takes nothing for the idle time, or the request runs
+ *     out of time, its write side is shut down, and a failed write ends
+ *     the connection.
+ */
+static void client_send(int fd, client_t *c, twheel_t *tw, rio_iov_t *v)
+{
+    twheel_arm(tw, &c->deadline, fd, SHUT_WR,
+               deadline_budget(c->fetch.start_us, timeouts.idle_us));
+    if (rio_writev(fd, v) < 0)
+        c->keepalive = 0;
+    twheel_cancel(tw, &c->deadline);
+    if (c->deadline.expired)
+        c->keepalive = 0;
+}
+
+/* Send the proxy's own statistics report to the client c */
+static void serve_stats(int fd, client_t *c, twheel_t *tw)
+{
+    char body[MAXBUF], hdr[MAXLINE];
+    int n = format_stats(body, sizeof(body));
+    rio_iov_t v;
 
-    snprintf(body, sizeof(body),
+    snprintf(hdr, sizeof(hdr),
+             "HTTP/1.0 200 OK\r\n"
+             "Content-type: text/plain\r\n"
+             "Content-length: %d\r\n\r\n",
+             n);
+
+    rio_iovinit(&v);
+    rio_iovadd(&v, hdr, set_connection(c, hdr, strlen(hdr)));
+    rio_iovadd(&v, body, n);
+    client_send(fd, c, tw, &v);
+}
+
+/* Format an HTTP error response as a header block and an HTML body */
+void format_error(char *hdr, size_t hdrsz, char *body, size_t bodysz,
+                  const char *errnum, const char *shortmsg,
+                  const char *longmsg)
+{
+    snprintf(body, bodysz,
              "<html><title>Proxy Error</title>"
              "<body bgcolor=\"ffffff\">\r\n"
              "%s: %s\r\n"
@@ -413,12 +2452,140 @@ static void client_error(int fd, const char *cause, const char *errnum,
              "</body></html>",
              errnum, shortmsg, longmsg);
 
-    snprintf(hdr, sizeof(hdr),
+    snprintf(hdr, hdrsz,
              "HTTP/1.0 %s %s\r\n"
              "Content-type: text/html\r\n"
-             "Content-length: %zu\r\n\r\n",
+             "Content-length: %zu\r\n"
+             "Connection: close\r\n\r\n",
              errnum, shortmsg, strlen(body));
+}
+
+/* Format an HTTP error response into a malloc'd buffer */
+char *error_response(const char *errnum, const char *shortmsg,
+                     const char *longmsg, size_t *len)
+{
+    char body[MAXBUF], hdr[MAXLINE], *resp;
+    size_t hlen, blen;
+
+    format_error(hdr, sizeof(hdr), body, sizeof(body),
+                 errnum, shortmsg, longmsg);
+    hlen = strlen(hdr);
+    blen = strlen(body);
+    resp = Malloc(hlen + blen);
+    memcpy(resp, hdr, hlen);
+    memcpy(resp + hlen, body, blen);
+    *len = hlen + blen;
+    return resp;
+}
+
+/*
+ * prepare_request - act on a complete request head held in in and
+ *     parsed into hr, for engines that do their own socket I/O. If the
+ *     proxy can answer by itself (error, stats, 304 or cache hit), the
+ *     reply is returned as a malloc'd buffer in *resp and REQ_RESPOND is
+ *     returned. Otherwise host, port and the outbound request req are
+ *     filled in and REQ_FETCH is returned. uri, host and port must hold
+ *     MAXLINE bytes.
+ */
+int prepare_request(const char *in, const http_req_t *hr, char *uri,
+                    char *host, char *port, char *req, size_t reqsz,
+                    char **resp, size_t *resplen)
+{
+    char path[MAXLINE], line[MAXLINE];
+    reqhdrs_t rh;
+
+    if (!http_is(in, hr->method, "GET"))
+    {
+        *resp = error_response("501", "Not Implemented",
+                               "Proxy does not implement this method",
+                               resplen);
+        return REQ_RESPOND;
+    }
+    if (hr->uri.len >= MAXLINE)
+    {
+        *resp = error_response("414", "URI Too Long",
+                               "Proxy could not hold the URI", resplen);
+        return REQ_RESPOND;
+    }
+    memcpy(uri, in + hr->uri.off, hr->uri.len);
+    uri[hr->uri.len] = '\0';
+
+    reqhdrs_init(&rh, in, hr);
+    if (rh.has_body)
+    {
+        *resp = error_response("400", "Bad Request",
+                               "Proxy does not accept a request body",
+                               resplen);
+        return REQ_RESPOND;
+    }
+
+    /* Requests addressed to the proxy itself */
+    if (!strcmp(uri, STATS_PATH))
+    {
+        char body[MAXBUF];
+        int n = format_stats(body, sizeof(body));
+        size_t hlen;
+
+        snprintf(line, sizeof(line),
+                 "HTTP/1.0 200 OK\r\n"
+                 "Content-type: text/plain\r\n"
+                 "Content-length: %d\r\n\r\n",
+                 n);
+        hlen = strlen(line);
+        *resp = Malloc(hlen + n);
+        memcpy(*resp, line, hlen);
+        memcpy(*resp + hlen, body, n);
+        *resplen = hlen + n;
+        return REQ_RESPOND;
+    }
+
+    /* Check cache first */
+    int cache_idx = find_cache_hit(uri);
+    if (cache_idx != -1)
+    {
+        if (cache_not_modified(cache_idx, uri, &rh, line, sizeof(line)))
+        {
+            *resplen = strlen(line);
+            *resp = Malloc(*resplen);
+            memcpy(*resp, line, *resplen);
+            hotkey_update(&hotkeys, uri, *resplen);
+            return REQ_RESPOND;
+        }
+
+        char *buf = Malloc(MAX_OBJECT_SIZE);
+        int size = read_cache(cache_idx, uri, buf);
+        if (size >= 0)
+        {
+            *resp = buf;
+            *resplen = size;
+            hotkey_update(&hotkeys, uri, size);
+            return REQ_RESPOND;
+        }
+        Free(buf); /* Evicted since the lookup - fall through to a miss */
+    }
+
+    if (parse_uri(uri, host, port, path) < 0)
+    {
+        *resp = error_response("400", "Bad Request",
+                               "Proxy could not parse the URI", resplen);
+        return REQ_RESPOND;
+    }
+
+    build_request(req, reqsz, path, host, &rh, 0);
+    return REQ_FETCH;
+}
+
+/* Send HTTP error to client */
+static void client_error(int fd, const char *cause, const char *errnum,
+                         const char *shortmsg, const char *longmsg)
+{
+    char body[MAXBUF], hdr[MAXBUF];
+    rio_iov_t v;
 
-    Rio_writen(fd, hdr, strlen(hdr));
-    Rio_writen(fd, body, strlen(body));
+    format_error(hdr, sizeof(hdr), body, sizeof(body),
+                 errnum, shortmsg, longmsg);
+    rio_iovinit(&v);
+    rio_iovadd(&v, hdr, strlen(hdr));
+    rio_iovadd(&v, body, strlen(body));
+    rio_writev(fd, &v); /* The connection closes after an error anyway */
 }
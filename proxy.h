@@ -0,0 +1,92 @@
+/*
+ * proxy.h - request and cache routines shared by the connection engines
+ *     (include after csapp.h, http.h and hotkey.h)
+ */
+
+/* Recommended max cache and object sizes */
+#define MAX_CACHE_SIZE 1049000
+#define MAX_OBJECT_SIZE 102400
+#define VALIDATOR_LEN 256
+
+#define STATS_PATH "/stats"
+
+/* Outcomes of prepare_request */
+#define REQ_RESPOND 0 /* The proxy answers by itself */
+#define REQ_FETCH 1   /* The request must go to the end server */
+
+/* Client request headers, parsed in place before the cache lookup */
+typedef struct
+{
+    const char *head;      /* The request head the views refer to */
+    const http_req_t *req; /* Its parse */
+    int if_none_match;     /* Validator fields' indices, -1 if absent */
+    int if_modified_since;
+    int conn_close;     /* Connection or Proxy-Connection said close */
+    int conn_keepalive; /* ... or keep-alive */
+    int has_body;       /* Content-Length other than 0, or Transfer-Encoding */
+    unsigned long long forward; /* Bit i set if field i goes to the end
+                                   server (HTTP_MAX_FIELDS is 64) */
+} reqhdrs_t;
+
+/*
+ * A response copied for the cache while it is relayed. Nothing is known
+ * about it until its head is complete; the head then decides whether it
+ * is kept at all and, when it gives a Content-Length, the exact size to
+ * allocate. A zeroed objbuf_t is ready for use.
+ */
+typedef struct
+{
+    char *buf;  /* The copy, NULL if nothing is kept */
+    int size;   /* Bytes in buf, MAX_OBJECT_SIZE + 1 once it is dropped */
+    int cap;    /* Bytes allocated at buf */
+    int head;   /* Length of the head, 0 until it is complete */
+    int exact;  /* cap is the size the head announced */
+} objbuf_t;
+
+/* Per-phase deadlines, in microseconds */
+typedef struct
+{
+    long connect_us; /* Connecting to the end server */
+    long header_us;  /* Receiving the client's request header */
+    long idle_us;    /* Silence from the end server */
+    long total_us;   /* Whole transaction, from the request's arrival */
+    long keepalive_us; /* Idle client connection between requests */
+} timeouts_t;
+
+#define TIMEOUT_TICK_US 100000L /* Resolution of the deadline wheels */
+#define ACCEPT_BACKOFF_US 10000 /* Pause after accept runs out of resources */
+
+extern hotkey_t hotkeys;
+extern timeouts_t timeouts;
+
+/* Request handling */
+int parse_uri(const char *uri, char *host, char *port, char *path);
+void reqhdrs_init(reqhdrs_t *rh, const char *head, const http_req_t *req);
+void build_request(char *dst, size_t dstsz,
+                   const char *path, const char *host,
+                   const reqhdrs_t *rh, int keepalive);
+int get_header(const char *msg, int size, const char *name,
+               char *val, size_t valsz);
+int cacheable_response(const char *buf, int size);
+void objbuf_init(objbuf_t *ob);
+void objbuf_add(objbuf_t *ob, const char *data, int n);
+char *objbuf_take(objbuf_t *ob, int *size);
+void objbuf_free(objbuf_t *ob);
+void format_error(char *hdr, size_t hdrsz, char *body, size_t bodysz,
+                  const char *errnum, const char *shortmsg,
+                  const char *longmsg);
+int format_stats(char *body, size_t bodysz);
+char *error_response(const char *errnum, const char *shortmsg,
+                     const char *longmsg, size_t *len);
+int prepare_request(const char *in, const http_req_t *hr, char *uri,
+                    char *host, char *port, char *req, size_t reqsz,
+                    char **resp, size_t *resplen);
+long now_us(void);
+long deadline_budget(long start_us, long phase_us);
+
+/* Cache functions */
+int find_cache_hit(char *url);
+void write_cache(char *buf, char *url, int size, long fetch_us);
+int read_cache(int idx, char *url, char *buf);
+int cache_not_modified(int idx, char *url, const reqhdrs_t *rh,
+                       char *hdr, size_t hdrsz);
@@ -0,0 +1,196 @@
+/*
+ * proxybench.c - closed-loop load generator for the proxy
+ *
+ * usage: proxybench [-k] <proxy host> <proxy port> <url> <clients> <requests>
+ *
+ * Each of <clients> threads sends <requests> GET requests for <url>
+ * through the proxy, one at a time, and times each from connect to
+ * end of response. A "%d" in <url> is replaced by a unique request
+ * number, which turns every request into a cache miss. With -k each
+ * client keeps one HTTP/1.1 connection open for all its requests and
+ * times each from request to end of response. Prints throughput and
+ * latency percentiles.
+ */
+#include "csapp.h"
+
+static char *phost, *pport, *url;
+static int nreqs;
+static int keepalive;        /* Reuse one connection per client (-k) */
+static long *lat;            /* Per-request latency in microseconds */
+static int nlat;
+static int failures;
+static sem_t mutex;          /* Protects nlat and failures */
+
+static long bench_now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+/* Fetch one URL through the proxy; returns 0 on a complete 2xx/3xx reply */
+static int fetch(const char *u)
+{
+    int fd, n, ok = 0;
+    char buf[MAXBUF];
+    rio_t rio;
+
+    if ((fd = open_clientfd(phost, pport)) < 0)
+        return -1;
+    snprintf(buf, sizeof(buf), "GET %s HTTP/1.0\r\n\r\n", u);
+    if (rio_writen(fd, buf, strlen(buf)) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    rio_readinitb(&rio, fd);
+    if (rio_readlineb(&rio, buf, sizeof(buf)) > 0 &&
+        (strstr(buf, " 2") || strstr(buf, " 3")))
+        ok = 1;
+    while ((n = rio_readnb(&rio, buf, sizeof(buf))) > 0)
+        ;
+    close(fd);
+    return ok && n == 0 ? 0 : -1;
+}
+
+/*
+ * Fetch one URL over the persistent connection *fd, opening it first if
+ * needed. The response must carry a Content-length. Returns 0 on a
+ * complete 2xx/3xx reply, leaving *fd open if the proxy keeps it.
+ */
+static int fetch_keepalive(int *fd, rio_t *rio, const char *u)
+{
+    char buf[MAXBUF];
+    long clen = -1;
+    int ok, close_after = 0;
+
+    if (*fd < 0)
+    {
+        if ((*fd = open_clientfd(phost, pport)) < 0)
+            return -1;
+        rio_readinitb(rio, *fd);
+    }
+    snprintf(buf, sizeof(buf), "GET %s HTTP/1.1\r\n\r\n", u);
+    if (rio_writen(*fd, buf, strlen(buf)) < 0 ||
+        rio_readlineb(rio, buf, sizeof(buf)) <= 0)
+        goto fail;
+    ok = strstr(buf, " 2") || strstr(buf, " 3");
+    while (rio_readlineb(rio, buf, sizeof(buf)) > 0 && strcmp(buf, "\r\n"))
+    {
+        if (!strncasecmp(buf, "Content-length:", 15))
+            clen = atol(buf + 15);
+        else if (!strncasecmp(buf, "Connection: close", 17))
+            close_after = 1;
+    }
+    while (clen > 0)
+    {
+        ssize_t n = rio_readnb(rio, buf, clen < MAXBUF ? clen : MAXBUF);
+        if (n <= 0)
+            goto fail;
+        clen -= n;
+    }
+    if (clen < 0 || !ok)
+        goto fail;
+    if (close_after)
+    {
+        close(*fd);
+        *fd = -1;
+    }
+    return 0;
+
+fail:
+    close(*fd);
+    *fd = -1;
+    return -1;
+}
+
+static void *client(void *vargp)
+{
+    int id = *(int *)vargp, fd = -1;
+    char u[MAXLINE];
+    rio_t rio;
+
+    for (int i = 0; i < nreqs; i++)
+    {
+        long start;
+        int rc;
+
+        snprintf(u, sizeof(u), url, id * nreqs + i);
+        start = bench_now_us();
+        rc = keepalive ? fetch_keepalive(&fd, &rio, u) : fetch(u);
+
+        P(&mutex);
+        if (rc < 0)
+            failures++;
+        else
+            lat[nlat++] = bench_now_us() - start;
+        V(&mutex);
+    }
+    if (fd >= 0)
+        close(fd);
+    return NULL;
+}
+
+static int cmp_long(const void *a, const void *b)
+{
+    long x = *(const long *)a, y = *(const long *)b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char **argv)
+{
+    int nclients, *ids;
+    pthread_t *tids;
+    long start, elapsed;
+
+    char *prog = argv[0];
+
+    if (argc > 1 && !strcmp(argv[1], "-k"))
+    {
+        keepalive = 1;
+        argv++;
+        argc--;
+    }
+    if (argc != 6)
+    {
+        fprintf(stderr,
+                "usage: %s [-k] <proxy host> <proxy port> <url> <clients> "
+                "<requests>\n",
+                prog);
+        exit(1);
+    }
+    phost = argv[1];
+    pport = argv[2];
+    url = argv[3];
+    nclients = atoi(argv[4]);
+    nreqs = atoi(argv[5]);
+    if (nclients <= 0 || nreqs <= 0)
+        app_error("clients and requests must be positive");
+
+    Signal(SIGPIPE, SIG_IGN);
+    Sem_init(&mutex, 0, 1);
+    lat = Malloc(sizeof(long) * nclients * nreqs);
+    tids = Malloc(sizeof(pthread_t) * nclients);
+    ids = Malloc(sizeof(int) * nclients);
+
+    start = bench_now_us();
+    for (int i = 0; i < nclients; i++)
+    {
+        ids[i] = i;
+        Pthread_create(&tids[i], NULL, client, &ids[i]);
+    }
+    for (int i = 0; i < nclients; i++)
+        Pthread_join(tids[i], NULL);
+    elapsed = bench_now_us() - start;
+
+    qsort(lat, nlat, sizeof(long), cmp_long);
+    printf("requests %d  failed %d  %.0f req/s", nlat, failures,
+           nlat * 1e6 / (elapsed ? elapsed : 1));
+    if (nlat > 0)
+        printf("  p50 %.2f ms  p99 %.2f ms  max %.2f ms",
+               lat[nlat / 2] / 1000.0, lat[(nlat * 99) / 100] / 1000.0,
+               lat[nlat - 1] / 1000.0);
+    printf("\n");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,129 @@
+/*
+ * ringbench.c - compare connection handoff through sbuf and mpmc
+ *
+ * usage: ringbench [handoffs]
+ *
+ * Ping-pong: two threads bounce an item through a pair of queues,
+ *     measuring one-way handoff latency when the consumer is asleep.
+ * Throughput: producers and consumers stream items through one queue
+ *     of SBUFSIZE slots, the shape of the proxy's acceptor and workers.
+ */
+#include "csapp.h"
+#include "sbuf.h"
+#include "mpmc.h"
+
+#define SBUFSIZE 16
+#define NPRODUCERS 2
+#define NCONSUMERS 4
+
+typedef struct
+{
+    const char *name;
+    void *(*create)(int n);
+    void (*insert)(void *q, int item);
+    int (*remove)(void *q);
+} queue_ops_t;
+
+static void *sbuf_create(int n)
+{
+    sbuf_t *sp = Malloc(sizeof(sbuf_t));
+    sbuf_init(sp, n);
+    return sp;
+}
+static void sbuf_put(void *q, int item) { sbuf_insert(q, item); }
+static int sbuf_get(void *q) { return sbuf_remove(q); }
+
+static void *mpmc_create(int n)
+{
+    mpmc_t *q;
+
+    if (posix_memalign((void **)&q, MPMC_CACHE_LINE, sizeof(mpmc_t)) != 0)
+        app_error("posix_memalign error");
+    mpmc_init(q, n);
+    return q;
+}
+static void mpmc_put(void *q, int item) { mpmc_insert(q, item); }
+static int mpmc_get(void *q) { return mpmc_remove(q); }
+
+static const queue_ops_t queues[] = {
+    {"sbuf", sbuf_create, sbuf_put, sbuf_get},
+    {"mpmc", mpmc_create, mpmc_put, mpmc_get},
+};
+
+static const queue_ops_t *ops;
+static void *q1, *q2;
+static long nitems;
+
+static long bench_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/* Echo every item from q1 back through q2 */
+static void *ponger(void *vargp)
+{
+    for (long i = 0; i < nitems; i++)
+        ops->insert(q2, ops->remove(q1));
+    return NULL;
+}
+
+static void *producer(void *vargp)
+{
+    for (long i = 0; i < nitems / NPRODUCERS; i++)
+        ops->insert(q1, (int)i);
+    return NULL;
+}
+
+static void *consumer(void *vargp)
+{
+    for (long i = 0; i < nitems / NCONSUMERS; i++)
+        ops->remove(q1);
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    nitems = argc > 1 ? atol(argv[1]) : 200000;
+    nitems -= nitems % (NPRODUCERS * NCONSUMERS);
+    if (nitems <= 0)
+        app_error("handoffs must be positive");
+
+    for (int k = 0; k < (int)(sizeof(queues) / sizeof(queues[0])); k++)
+    {
+        pthread_t tid[NPRODUCERS + NCONSUMERS];
+        long start, pingpong, stream;
+
+        ops = &queues[k];
+
+        q1 = ops->create(SBUFSIZE);
+        q2 = ops->create(SBUFSIZE);
+        start = bench_now_ns();
+        Pthread_create(&tid[0], NULL, ponger, NULL);
+        for (long i = 0; i < nitems; i++)
+        {
+            ops->insert(q1, (int)i);
+            ops->remove(q2);
+        }
+        Pthread_join(tid[0], NULL);
+        pingpong = bench_now_ns() - start;
+
+        q1 = ops->create(SBUFSIZE);
+        start = bench_now_ns();
+        for (int i = 0; i < NPRODUCERS; i++)
+            Pthread_create(&tid[i], NULL, producer, NULL);
+        for (int i = 0; i < NCONSUMERS; i++)
+            Pthread_create(&tid[NPRODUCERS + i], NULL, consumer, NULL);
+        for (int i = 0; i < NPRODUCERS + NCONSUMERS; i++)
+            Pthread_join(tid[i], NULL);
+        stream = bench_now_ns() - start;
+
+        printf("%s: handoff latency %.0f ns, throughput %.2f M items/s "
+               "(%dP/%dC)\n",
+               ops->name, pingpong / (2.0 * nitems),
+               nitems * 1e3 / stream, NPRODUCERS, NCONSUMERS);
+    }
+    return 0;
+}
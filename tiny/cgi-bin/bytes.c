@@ -0,0 +1,17 @@
+/* bytes.c - a CGI program that sends as many bytes as its query asks */
+#include <stdlib.h>
+#include "csapp.h"
+
+int main(void)
+{
+    const char *qs = getenv("QUERY_STRING");
+    long n = qs ? atol(qs) : 0;
+    char buf[MAXBUF];
+
+    printf("Content-type: application/octet-stream\r\n");
+    printf("Content-length: %ld\r\n\r\n", n);
+    memset(buf, 'x', sizeof(buf));
+    for (; n > 0; n -= sizeof(buf))
+        fwrite(buf, 1, n < (long)sizeof(buf) ? n : (long)sizeof(buf), stdout);
+    exit(0);
+}
@@ -0,0 +1,16 @@
+/*
+ * chunked.c - a CGI program whose response is chunked but also carries
+ * a wrong Content-Length, as a broken origin might send
+ */
+#include <stdlib.h>
+#include "csapp.h"
+
+int main(void)
+{
+    printf("Content-type: text/plain\r\n");
+    printf("Cache-Control: max-age=60\r\n");
+    printf("Transfer-Encoding: chunked\r\n");
+    printf("Content-Length: 999\r\n\r\n");
+    printf("5\r\nhello\r\n0\r\n\r\n");
+    exit(0);
+}
@@ -23,6 +23,7 @@
  */
 /* $begin csapp.c */
 #include "csapp.h"
+#include <poll.h>
 
 /************************** 
  * Error-handling functions
@@ -792,6 +793,64 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n)
 }
 /* $end rio_writen */
 
+/*
+ * rio_iovinit - Start gathering a new message in vp
+ */
+void rio_iovinit(rio_iov_t *vp)
+{
+    vp->rio_iovcnt = 0;
+    vp->rio_len = 0;
+}
+
+/*
+ * rio_iovadd - Append the n bytes at buf to the message in vp; they
+ *    must stay put until it is written. Returns -1 if vp is full.
+ */
+int rio_iovadd(rio_iov_t *vp, void *buf, size_t n)
+{
+    if (n == 0)
+	return 0;
+    if (vp->rio_iovcnt == RIO_IOVMAX)
+	return -1;
+    vp->rio_iov[vp->rio_iovcnt].iov_base = buf;
+    vp->rio_iov[vp->rio_iovcnt++].iov_len = n;
+    vp->rio_len += n;
+    return 0;
+}
+
+/*
+ * rio_writev - Robustly write the message gathered in vp (unbuffered).
+ *    One writev sends all of it unless the socket buffer fills; a
+ *    short write resumes where it stopped. Consumes vp.
+ */
+ssize_t rio_writev(int fd, rio_iov_t *vp)
+{
+    struct iovec *iov = vp->rio_iov;
+    int cnt = vp->rio_iovcnt;
+    size_t nleft = vp->rio_len;
+    ssize_t nwritten;
+
+    while (nleft > 0) {
+	if ((nwritten = writev(fd, iov, cnt)) <= 0) {
+	    if (errno == EINTR)  /* Interrupted by sig handler return */
+		nwritten = 0;    /* and call writev() again */
+	    else
+		return -1;       /* errno set by writev() */
+	}
+	nleft -= nwritten;
+	while (cnt > 0 && (size_t)nwritten >= iov->iov_len) {
+	    nwritten -= iov->iov_len; /* Skip the pieces written */
+	    iov++;
+	    cnt--;
+	}
+	if (cnt > 0) {
+	    iov->iov_base = (char *)iov->iov_base + nwritten;
+	    iov->iov_len -= nwritten;
+	}
+    }
+    return vp->rio_len;
+}
+
 
 /* 
  * rio_read - This is a wrapper for the Unix read() function that
@@ -870,29 +929,97 @@ ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n)
 /* $begin rio_readlineb */
 ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) 
 {
-    int n, rc;
-    char c, *bufp = usrbuf;
-
-    for (n = 1; n < maxlen; n++) { 
-        if ((rc = rio_read(rp, &c, 1)) == 1) {
-	    *bufp++ = c;
-	    if (c == '\n') {
-                n++;
-     		break;
-            }
-	} else if (rc == 0) {
-	    if (n == 1)
-		return 0; /* EOF, no data read */
-	    else
-		break;    /* EOF, some data was read */
-	} else
-	    return -1;	  /* Error */
+    size_t n = 0, k;
+    char *bufp = usrbuf, *nl = NULL;
+
+    /* Copy whole runs of the buffer, up to the first newline in each */
+    while (!nl && n + 1 < maxlen) {
+        if (rp->rio_cnt <= 0) {
+            int rc = rio_read(rp, bufp + n, 1);  /* Refill */
+
+            if (rc < 0)
+                return -1;     /* Error */
+            if (rc == 0)
+                break;         /* EOF */
+            if (bufp[n++] == '\n')
+                break;
+            continue;
+        }
+        k = maxlen - 1 - n;
+        if (k > rp->rio_cnt)
+            k = rp->rio_cnt;
+        if ((nl = memchr(rp->rio_bufptr, '\n', k)))
+            k = nl - rp->rio_bufptr + 1;
+        memcpy(bufp + n, rp->rio_bufptr, k);
+        rp->rio_bufptr += k;
+        rp->rio_cnt -= k;
+        n += k;
     }
-    *bufp = 0;
-    return n-1;
+    bufp[n] = 0;
+    return n;
 }
 /* $end rio_readlineb */
 
+/*
+ * rio_fillb - Read more bytes into rp's buffer after those still
+ *     unread, first sliding them to the front if they reach its end.
+ *     Unread bytes stay unread, but rio_bufptr may move. Returns the
+ *     number of bytes read, 0 on EOF or if the buffer is full of unread
+ *     bytes, or -1 on error.
+ */
+ssize_t rio_fillb(rio_t *rp) 
+{
+    char *end = rp->rio_buf + sizeof(rp->rio_buf);
+    ssize_t rc;
+
+    if (rp->rio_cnt <= 0) {
+        rp->rio_cnt = 0;
+        rp->rio_bufptr = rp->rio_buf;
+    }
+    if (rp->rio_bufptr + rp->rio_cnt == end) {
+        if (rp->rio_bufptr == rp->rio_buf)
+            return 0;          /* Full */
+        memmove(rp->rio_buf, rp->rio_bufptr, rp->rio_cnt);
+        rp->rio_bufptr = rp->rio_buf;
+    }
+    while ((rc = read(rp->rio_fd, rp->rio_bufptr + rp->rio_cnt,
+                      end - (rp->rio_bufptr + rp->rio_cnt))) < 0)
+        if (errno != EINTR)    /* Interrupted by sig handler return */
+            return -1;
+    rp->rio_cnt += rc;
+    return rc;
+}
+
+/*
+ * rio_readlinep - Robustly read a text line (buffered) without copying
+ *     it: *linep is set to the line inside rp's buffer, which stays
+ *     valid until the next read from rp. The line is not null
+ *     terminated. A line longer than the buffer comes back in pieces.
+ *     Returns its length, 0 on EOF, or -1 on error.
+ */
+ssize_t rio_readlinep(rio_t *rp, char **linep) 
+{
+    char *nl;
+    size_t scanned = 0, n;
+    ssize_t rc;
+
+    if (rp->rio_cnt < 0)
+        rp->rio_cnt = 0;
+    while (!(nl = memchr(rp->rio_bufptr + scanned, '\n',
+                         rp->rio_cnt - scanned))) {
+        scanned = rp->rio_cnt;
+        if ((rc = rio_fillb(rp)) < 0)
+            return -1;         /* Error */
+        if (rc == 0)
+            break;             /* EOF, or a full buffer handed back as is */
+    }
+    n = nl ? nl + 1 - rp->rio_bufptr : rp->rio_cnt;
+    *linep = rp->rio_bufptr;
+    rp->rio_bufptr += n;
+    rp->rio_cnt -= n;
+    return n;
+}
+
 /**********************************
  * Wrappers for robust I/O routines
  **********************************/
@@ -911,6 +1038,12 @@ void Rio_writen(int fd, void *usrbuf, size_t n)
 	unix_error("Rio_writen error");
 }
 
+void Rio_writev(int fd, rio_iov_t *vp)
+{
+    if (rio_writev(fd, vp) != vp->rio_len)
+	unix_error("Rio_writev error");
+}
+
 void Rio_readinitb(rio_t *rp, int fd)
 {
     rio_readinitb(rp, fd);
@@ -948,8 +1081,97 @@ ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
  */
 /* $begin open_clientfd */
 int open_clientfd(char *hostname, char *port) {
-    int clientfd, rc;
-    struct addrinfo hints, *listp, *p;
+    return open_clientfd_timed(hostname, port, -1);
+}
+/* $end open_clientfd */
+
+#define CONNECT_MAXADDRS 16 /* Addresses raced per connection */
+
+static long clock_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+/*
+ * order_addrs - Copy up to max entries of listp into addrs, alternating
+ *     address families starting with the resolver's first choice, so
+ *     that a dead IPv6 path is raced against IPv4 rather than tried to
+ *     exhaustion first (RFC 8305, section 4). Returns the count.
+ */
+static int order_addrs(struct addrinfo *listp, struct addrinfo **addrs, int max)
+{
+    struct addrinfo *same = listp, *other = listp;
+    int n = 0, turn = 0;
+
+    while (n < max) {
+        struct addrinfo **pp = turn ? &other : &same;
+
+        /* Advance this family's cursor to its next address */
+        while (*pp && (turn ? (*pp)->ai_family == listp->ai_family
+                            : (*pp)->ai_family != listp->ai_family))
+            *pp = (*pp)->ai_next;
+        if (*pp) {
+            addrs[n++] = *pp;
+            *pp = (*pp)->ai_next;
+        }
+        else if (!(turn ? same : other))
+            break; /* Both families exhausted */
+        turn = !turn;
+    }
+    return n;
+}
+
+/*
+ * connect_start - Begin a non-blocking connect to p. Returns the socket,
+ *     with *done set if the connection completed at once, or -1 with
+ *     errno set if the attempt failed outright.
+ */
+static int connect_start(struct addrinfo *p, int *done)
+{
+    int fd, flags;
+
+    if ((fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0)
+        return -1;
+    if ((flags = fcntl(fd, F_GETFL, 0)) < 0 ||
+        fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        close(fd);
+        return -1;
+    }
+    *done = 0;
+    if (connect(fd, p->ai_addr, p->ai_addrlen) == 0)
+        *done = 1;
+    else if (errno != EINPROGRESS) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * open_clientfd_timed - Like open_clientfd, but gives up after
+ *     timeout_ms milliseconds (never, if timeout_ms < 0).
+ *
+ *     The addresses are raced Happy Eyeballs style: each attempt gets a
+ *     CONNECT_STAGGER_MS head start before the next address is tried in
+ *     parallel, a failed attempt starts the next at once, and the first
+ *     connection to complete wins. An unreachable address thus costs
+ *     one stagger instead of a full TCP timeout.
+ *
+ *     On error, returns: 
+ *       -2 for getaddrinfo error
+ *       -1 with errno set for other errors (ETIMEDOUT if no address
+ *          answered in time).
+ */
+int open_clientfd_timed(char *hostname, char *port, int timeout_ms) {
+    int rc, i, n, next = 0, nfds = 0, clientfd = -1, done, err = ECONNREFUSED;
+    long now, deadline, next_start;
+    struct addrinfo hints, *listp, *addrs[CONNECT_MAXADDRS];
+    struct pollfd pfds[CONNECT_MAXADDRS];
 
     /* Get a list of potential server addresses */
     memset(&hints, 0, sizeof(struct addrinfo));
@@ -960,30 +1182,90 @@ int open_clientfd(char *hostname, char *port) {
         fprintf(stderr, "getaddrinfo failed (%s:%s): %s\n", hostname, port, gai_strerror(rc));
         return -2;
     }
-  
-    /* Walk the list for one that we can successfully connect to */
-    for (p = listp; p; p = p->ai_next) {
-        /* Create a socket descriptor */
-        if ((clientfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0) 
-            continue; /* Socket failed, try the next */
+    n = order_addrs(listp, addrs, CONNECT_MAXADDRS);
+
+    now = clock_ms();
+    deadline = timeout_ms < 0 ? -1 : now + timeout_ms;
+    next_start = now;
+    while (clientfd < 0 && (next < n || nfds > 0)) {
+        long wait = -1;
+
+        /* Start the next address when its turn comes, or when idle */
+        now = clock_ms();
+        if (next < n && (now >= next_start || nfds == 0)) {
+            int fd = connect_start(addrs[next++], &done);
+
+            if (fd < 0) {
+                err = errno;
+                continue; /* Failed outright, try the next at once */
+            }
+            if (done) {
+                clientfd = fd;
+                break;
+            }
+            pfds[nfds].fd = fd;
+            pfds[nfds].events = POLLOUT;
+            nfds++;
+            next_start = now + CONNECT_STAGGER_MS;
+            continue;
+        }
+        if (deadline >= 0 && now >= deadline) {
+            err = ETIMEDOUT;
+            break;
+        }
 
-        /* Connect to the server */
-        if (connect(clientfd, p->ai_addr, p->ai_addrlen) != -1) 
-            break; /* Success */
-        if (close(clientfd) < 0) { /* Connect failed, try another */  //line:netp:openclientfd:closefd
-            fprintf(stderr, "open_clientfd: close failed: %s\n", strerror(errno));
-            return -1;
-        } 
-    } 
+        /* Sleep until an attempt finishes, the next starts, or time's up */
+        if (next < n)
+            wait = next_start - now;
+        if (deadline >= 0 && (wait < 0 || deadline - now < wait))
+            wait = deadline - now;
+        if ((rc = poll(pfds, nfds, (int)wait)) < 0) {
+            if (errno == EINTR)
+                continue;
+            err = errno;
+            break;
+        }
 
-    /* Clean up */
+        /* Writable: that handshake finished, successfully or not */
+        for (i = 0; rc > 0 && i < nfds; ) {
+            int soerr = 0;
+            socklen_t len = sizeof(soerr);
+
+            if (!pfds[i].revents) {
+                i++;
+                continue;
+            }
+            rc--;
+            if (getsockopt(pfds[i].fd, SOL_SOCKET, SO_ERROR, &soerr, &len) < 0)
+                soerr = errno;
+            if (!soerr) {
+                clientfd = pfds[i].fd;
+                pfds[i] = pfds[--nfds];
+                break; /* Success */
+            }
+            err = soerr;
+            close(pfds[i].fd); /* Connect failed, start another */
+            pfds[i] = pfds[--nfds];
+            next_start = now;
+        }
+    }
+
+    /* Clean up the losers */
+    for (i = 0; i < nfds; i++)
+        close(pfds[i].fd);
     freeaddrinfo(listp);
-    if (!p) /* All connects failed */
+    if (clientfd < 0) { /* All connects failed */
+        errno = err;
+        return -1;
+    }
+    if (fcntl(clientfd, F_SETFL, fcntl(clientfd, F_GETFL, 0) & ~O_NONBLOCK) < 0) {
+        err = errno;
+        close(clientfd);
+        errno = err;
         return -1;
-    else    /* The last connect succeeded */
-        return clientfd;
+    }
+    return clientfd;
 }
-/* $end open_clientfd */
 
 /*  
  * open_listenfd - Open and return a listening socket on port. This
@@ -994,7 +1276,7 @@ int open_clientfd(char *hostname, char *port) {
  *       -1 with errno set for other errors.
  */
 /* $begin open_listenfd */
-int open_listenfd(char *port) 
+static int open_listenfd_opt(char *port, int reuseport) 
 {
     struct addrinfo hints, *listp, *p;
     int listenfd, rc, optval=1;
@@ -1019,6 +1301,15 @@ int open_listenfd(char *port)
         setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR,    //line:netp:csapp:setsockopt
                    (const void *)&optval , sizeof(int));
 
+        /* Let several sockets share the port; the kernel spreads
+           incoming connections across them */
+        if (reuseport &&
+            setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT,
+                       (const void *)&optval, sizeof(int)) < 0) {
+            close(listenfd);
+            continue;
+        }
+
         /* Bind the descriptor to the address */
         if (bind(listenfd, p->ai_addr, p->ai_addrlen) == 0)
             break; /* Success */
@@ -1041,6 +1332,21 @@ int open_listenfd(char *port)
     }
     return listenfd;
 }
+
+int open_listenfd(char *port) 
+{
+    return open_listenfd_opt(port, 0);
+}
+
+/*
+ * open_listenfd_reuseport - Like open_listenfd, but sets SO_REUSEPORT
+ *     so that several sockets (one per core, say) can listen on the
+ *     same port, each with its own accept queue.
+ */
+int open_listenfd_reuseport(char *port) 
+{
+    return open_listenfd_opt(port, 1);
+}
 /* $end open_listenfd */
 
 /****************************************************
@@ -1064,6 +1370,15 @@ int Open_listenfd(char *port)
     return rc;
 }
 
+int Open_listenfd_reuseport(char *port) 
+{
+    int rc;
+
+    if ((rc = open_listenfd_reuseport(port)) < 0)
+	unix_error("Open_listenfd_reuseport error");
+    return rc;
+}
+
 /* $end csapp.c */
 
 
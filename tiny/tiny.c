@@ -1,4 +1,5 @@
 #include "csapp.h"
+#include <netinet/tcp.h>
 
 void doit(int fd);
 void read_requesthdrs(rio_t *rp);
@@ -142,29 +143,30 @@ int parse_uri(char *uri, char *filename, char *cgiargs)
 void serve_static(int fd, char *filename, int filesize, int is_get)
 {
     int srcfd;
-    char *srcp, filetype[MAXLINE], buf[MAXBUF];
+    char *srcp = NULL, filetype[MAXLINE], buf[MAXBUF];
+    rio_iov_t v;
 
-    /* Send response headers to client */
+    /* Build response headers */
     get_filetype(filename, filetype);
     sprintf(buf, "HTTP/1.0 200 OK\r\n");
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Server: Tiny Web Server\r\n");
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-length: %d\r\n", filesize);
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-type: %s\r\n\r\n", filetype);
-    Rio_writen(fd, buf, strlen(buf));
-
-    /* Send response body to client */
-    if (!is_get)
-        return;
-
-    srcfd = Open(filename, O_RDONLY, 0);
-    srcp = Malloc(filesize);
-    rio_readn(srcfd, srcp, filesize);
+    sprintf(buf + strlen(buf), "Server: Tiny Web Server\r\n");
+    sprintf(buf + strlen(buf), "Content-length: %d\r\n", filesize);
+    sprintf(buf + strlen(buf), "Content-type: %s\r\n\r\n", filetype);
+    rio_iovinit(&v);
+    rio_iovadd(&v, buf, strlen(buf));
+
+    /* Read response body */
+    if (is_get)
+    {
+        srcfd = Open(filename, O_RDONLY, 0);
+        srcp = Malloc(filesize);
+        rio_readn(srcfd, srcp, filesize);
+        Close(srcfd);
+        rio_iovadd(&v, srcp, filesize);
+    }
 
-    Close(srcfd);
-    Rio_writen(fd, srcp, filesize);
+    /* Send headers and body to client in one writev */
+    Rio_writev(fd, &v);
     Free(srcp);
 }
 
@@ -189,11 +191,19 @@ void get_filetype(char *filename, char *filetype)
 void serve_dynamic(int fd, char *filename, char *cgiargs)
 {
     char buf[MAXLINE], *emptylist[] = {NULL};
+    int on = 1, off = 0;
+
+    /*
+     * Cork the socket so that the first part of the response waits for
+     * the CGI program's output and leaves in the same segments; sent on
+     * its own, the program's first write would sit behind Nagle until
+     * the client's delayed ACK
+     */
+    setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
 
     /* Return first part of HTTP response */
     sprintf(buf, "HTTP/1.0 200 OK\r\n");
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Server: Tiny Web Server\r\n");
+    sprintf(buf + strlen(buf), "Server: Tiny Web Server\r\n");
     Rio_writen(fd, buf, strlen(buf));
 
     if (Fork() == 0)
@@ -204,31 +214,32 @@ void serve_dynamic(int fd, char *filename, char *cgiargs)
         Execve(filename, emptylist, environ); /* Run CGI program */
     }
     Wait(NULL); /* Parent waits for and reaps child */
+    setsockopt(fd, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
 }
 
 /* clienterror - returns an error message to the client */
 void clienterror(int fd, char *cause, char *errnum,
                  char *shortmsg, char *longmsg)
 {
-    char buf[MAXLINE];
+    char buf[MAXLINE], body[MAXBUF];
+    rio_iov_t v;
 
-    /* Print the HTTP response headers */
+    /* Build the HTTP response headers */
     sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-type: text/html\r\n\r\n");
-    Rio_writen(fd, buf, strlen(buf));
-
-    /* Print the HTTP response body */
-    sprintf(buf, "<html><title>Tiny Error</title>");
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "<body bgcolor="
-                 "ffffff"
-                 ">\r\n");
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "%s: %s\r\n", errnum, shortmsg);
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "<p>%s: %s\r\n", longmsg, cause);
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "<hr><em>The Tiny Web server</em>\r\n");
-    Rio_writen(fd, buf, strlen(buf));
+    sprintf(buf + strlen(buf), "Content-type: text/html\r\n\r\n");
+
+    /* Build the HTTP response body */
+    sprintf(body, "<html><title>Tiny Error</title>");
+    sprintf(body + strlen(body), "<body bgcolor="
+                                 "ffffff"
+                                 ">\r\n");
+    sprintf(body + strlen(body), "%s: %s\r\n", errnum, shortmsg);
+    sprintf(body + strlen(body), "<p>%s: %s\r\n", longmsg, cause);
+    sprintf(body + strlen(body), "<hr><em>The Tiny Web server</em>\r\n");
+
+    /* Print both with one writev */
+    rio_iovinit(&v);
+    rio_iovadd(&v, buf, strlen(buf));
+    rio_iovadd(&v, body, strlen(body));
+    Rio_writev(fd, &v);
 }
\ No newline at end of file
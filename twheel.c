@@ -0,0 +1,122 @@
+/*
+ * twheel.c - hashed timer wheel for connection deadlines
+ *
+ * Timers hash into TW_SLOTS slots by expiry tick, so arming, re-arming
+ * and cancelling are O(1) list operations; a timer further out than one
+ * revolution just stays in its slot until its tick comes round. A
+ * watchdog thread advances the wheel every tick and shuts down the
+ * sockets of whatever has expired. That happens with the wheel locked,
+ * so once twheel_cancel returns the socket will not be touched and the
+ * owner may close it.
+ */
+#include "csapp.h"
+#include "twheel.h"
+
+static long tw_now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+static void tw_unlink(twheel_t *tw, twtimer_t *t)
+{
+    if (t->prev)
+        t->prev->next = t->next;
+    else
+        tw->slots[t->slot] = t->next;
+    if (t->next)
+        t->next->prev = t->prev;
+    t->slot = -1;
+}
+
+/* Fire every timer due at or before tick; wheel is locked */
+static void tw_expire(twheel_t *tw, long tick)
+{
+    twtimer_t *t = tw->slots[tick % TW_SLOTS], *next;
+
+    for (; t; t = next)
+    {
+        next = t->next;
+        if (t->expires <= tick)
+        {
+            tw_unlink(tw, t);
+            t->expired = 1;
+            shutdown(t->fd, t->how);
+        }
+    }
+}
+
+static void *tw_watchdog(void *vargp)
+{
+    twheel_t *tw = vargp;
+
+    Pthread_detach(pthread_self());
+    while (1)
+    {
+        long target;
+
+        usleep(tw->tick_us);
+        target = (tw_now_us() - tw->origin_us) / tw->tick_us;
+
+        P(&tw->mutex);
+        while (tw->now < target)
+            tw_expire(tw, ++tw->now);
+        V(&tw->mutex);
+    }
+    return NULL;
+}
+
+/* Create an empty wheel of tick_us resolution and start its watchdog */
+void twheel_init(twheel_t *tw, long tick_us)
+{
+    pthread_t tid;
+
+    memset(tw, 0, sizeof(*tw));
+    tw->tick_us = tick_us;
+    tw->origin_us = tw_now_us();
+    Sem_init(&tw->mutex, 0, 1);
+    Pthread_create(&tid, NULL, tw_watchdog, tw);
+}
+
+/* Prepare t as an unarmed, unexpired timer */
+void twtimer_init(twtimer_t *t)
+{
+    t->next = t->prev = NULL;
+    t->slot = -1;
+    t->expired = 0;
+}
+
+/*
+ * twheel_arm - (re)arm t to shutdown(fd, how) delay_us from now,
+ *     rounded up to a whole tick
+ */
+void twheel_arm(twheel_t *tw, twtimer_t *t, int fd, int how, long delay_us)
+{
+    long ticks = (delay_us + tw->tick_us - 1) / tw->tick_us;
+
+    P(&tw->mutex);
+    if (t->slot >= 0)
+        tw_unlink(tw, t);
+    t->fd = fd;
+    t->how = how;
+    t->expired = 0;
+    t->expires = tw->now + (ticks > 0 ? ticks : 1);
+    t->slot = t->expires % TW_SLOTS;
+    t->prev = NULL;
+    t->next = tw->slots[t->slot];
+    if (t->next)
+        t->next->prev = t;
+    tw->slots[t->slot] = t;
+    V(&tw->mutex);
+}
+
+/* Disarm t if armed; its callback is guaranteed not to run afterwards */
+void twheel_cancel(twheel_t *tw, twtimer_t *t)
+{
+    P(&tw->mutex);
+    if (t->slot >= 0)
+        tw_unlink(tw, t);
+    V(&tw->mutex);
+}
@@ -0,0 +1,34 @@
+/*
+ * twheel.h - hashed timer wheel for connection deadlines
+ */
+#define TW_SLOTS 512 /* Slots per revolution */
+
+/*
+ * A deadline on a socket. When it expires the watchdog shuts the socket
+ * down, which wakes whoever is blocked on it (or, in the event engines,
+ * produces an event), and sets expired so the owner can tell a timeout
+ * from the peer closing.
+ */
+typedef struct twtimer
+{
+    struct twtimer *next, *prev; /* Links in a wheel slot */
+    long expires;                /* Tick at which it fires */
+    int slot;                    /* Slot it is linked in, or -1 */
+    int fd;                      /* Socket to shut down on expiry */
+    int how;                     /* SHUT_RD, SHUT_WR or SHUT_RDWR */
+    volatile int expired;        /* Set when the deadline passed */
+} twtimer_t;
+
+typedef struct
+{
+    twtimer_t *slots[TW_SLOTS];
+    long now;        /* Last tick processed */
+    long tick_us;    /* Resolution */
+    long origin_us;  /* Time of tick 0 */
+    sem_t mutex;     /* Protects everything above and all linked timers */
+} twheel_t;
+
+void twheel_init(twheel_t *tw, long tick_us);
+void twtimer_init(twtimer_t *t);
+void twheel_arm(twheel_t *tw, twtimer_t *t, int fd, int how, long delay_us);
+void twheel_cancel(twheel_t *tw, twtimer_t *t);
@@ -0,0 +1,741 @@
+/*
+ * uring.c - io_uring connection engine
+ *
+ * Same request flow as the epoll engine, but every socket operation is
+ * submitted to an io_uring and completed asynchronously, so each loop
+ * iteration costs one io_uring_enter() for any number of accepts,
+ * connects, receives and sends. A multishot accept keeps accepting
+ * without resubmission, and response bytes are relayed through buffers
+ * registered with the kernel once at startup. Each connection has at
+ * most one operation in flight, which keeps teardown trivial, and one
+ * deadline, armed on the socket that operation waits for: on expiry
+ * the socket is shut down and the operation completes early.
+ */
+#include "csapp.h"
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <netinet/tcp.h>
+#include <linux/io_uring.h>
+#include "http.h"
+#include "hotkey.h"
+#include "proxy.h"
+#include "offload.h"
+#include "twheel.h"
+#include "uring.h"
+
+#define UR_ENTRIES 256       /* Submission queue entries per ring */
+#define UR_NBUFS 64          /* Registered relay buffers per ring */
+#define UR_BUFSIZE 16384     /* Size of each relay buffer */
+#define UR_OFFLOAD_THREADS 4 /* Threads running blocking work */
+
+/* Operation tags, kept in the low bits of user_data */
+#define OP_ACCEPT 0  /* Accept on the listening socket, multishot if able */
+#define OP_WAKE 1    /* eventfd read: lookups completed */
+#define OP_RECV 2    /* Request bytes from the client */
+#define OP_CONNECT 3 /* Connect to the end server */
+#define OP_SENDREQ 4 /* Request to the end server */
+#define OP_READ 5    /* Response bytes from the end server */
+#define OP_WRITE 6   /* Response bytes to the client */
+#define OP_BACKOFF 7 /* Timeout before accepting again */
+#define OP_MASK 7
+
+typedef struct ring
+{
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned sq_entries;
+    unsigned pending;         /* SQEs queued since the last enter */
+
+    int listenfd;
+    int oneshot;              /* Multishot accept unsupported: one per SQE */
+    struct __kernel_timespec backoff; /* Pause before accepting again */
+    int efd;                  /* eventfd signalled when lookups complete */
+    uint64_t wakeval;         /* Target of the eventfd read */
+    struct uconn *done;       /* Connections whose lookup completed */
+    sem_t mutex;              /* Protects done */
+
+    twheel_t wheel;           /* Deadlines of this ring's connections */
+
+    char *bufs;               /* UR_NBUFS registered relay buffers */
+    int freebufs[UR_NBUFS];   /* Indices of unused relay buffers */
+    int nfree;
+} ring_t;
+
+typedef struct uconn
+{
+    task_t task;              /* Request lookups (must be first) */
+    struct uconn *next;       /* Link in the ring's done list */
+    ring_t *r;                /* Owning ring */
+    int fd;                   /* Client socket */
+    int sfd;                  /* End server socket, or -1 */
+    twtimer_t deadline;       /* Deadline of the operation in flight */
+    long start_us;            /* When the connection was accepted */
+
+    char in[MAXBUF];          /* Client request bytes */
+    size_t inlen;
+    http_req_t hreq;          /* Their parse, resumed as more arrive */
+
+    char *out;                /* Complete reply from the proxy itself */
+    size_t outlen, outoff;
+
+    char req[MAXBUF];         /* Request for the end server */
+    size_t reqlen, reqoff;
+
+    char uri[MAXLINE], host[MAXLINE], port[MAXLINE];
+    struct addrinfo *ai;      /* Lookup result */
+    struct addrinfo *aip;     /* Address being tried */
+    int gai_rc;
+    int action;               /* prepare_request's outcome: REQ_* */
+    char *resp;               /* The response for REQ_RESPOND */
+    size_t resplen;
+
+    char *buf;                /* Relay buffer */
+    int bidx;                 /* Its registered index, or -1 if on heap */
+    size_t buflen, bufoff;
+
+    objbuf_t obj;             /* Response kept for the cache */
+    long start;               /* now_us() when the fetch began */
+    long relayed;             /* Bytes relayed to the client */
+} uconn_t;
+
+static void submit_write(uconn_t *c);
+
+/*****************
+ * Ring plumbing
+ *****************/
+
+static void ring_setup(ring_t *r)
+{
+    struct io_uring_params p;
+    size_t sq_sz, cq_sz;
+    char *sq, *cq;
+
+    memset(&p, 0, sizeof(p));
+    if ((r->fd = syscall(__NR_io_uring_setup, UR_ENTRIES, &p)) < 0)
+        unix_error("io_uring_setup error");
+
+    sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        sq_sz = cq_sz = sq_sz > cq_sz ? sq_sz : cq_sz;
+
+    sq = Mmap(NULL, sq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+              r->fd, IORING_OFF_SQ_RING);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        cq = sq;
+    else
+        cq = Mmap(NULL, cq_sz, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    r->sqes = Mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   r->fd, IORING_OFF_SQES);
+
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    r->sq_entries = p.sq_entries;
+    r->pending = 0;
+}
+
+/* Register the relay buffers; without them relaying uses heap buffers */
+static void ring_register_buffers(ring_t *r)
+{
+    struct iovec iov[UR_NBUFS];
+
+    r->bufs = Malloc(UR_NBUFS * UR_BUFSIZE);
+    for (int i = 0; i < UR_NBUFS; i++)
+    {
+        iov[i].iov_base = r->bufs + i * UR_BUFSIZE;
+        iov[i].iov_len = UR_BUFSIZE;
+        r->freebufs[i] = i;
+    }
+    r->nfree = UR_NBUFS;
+    if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_BUFFERS,
+                iov, UR_NBUFS) < 0)
+    {
+        perror("io_uring_register: relaying without fixed buffers");
+        r->nfree = 0;
+    }
+}
+
+/* Submit queued SQEs and wait for at least min_complete completions */
+static void ring_enter(ring_t *r, unsigned min_complete)
+{
+    int rc = syscall(__NR_io_uring_enter, r->fd, r->pending, min_complete,
+                     min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (rc < 0)
+    {
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            unix_error("io_uring_enter error");
+        return;
+    }
+    r->pending -= rc < r->pending ? rc : r->pending;
+}
+
+/* Get a zeroed SQE tagged with (c, op); submits first if the SQ is full */
+static struct io_uring_sqe *ring_sqe(ring_t *r, void *c, int op)
+{
+    unsigned tail, idx;
+    struct io_uring_sqe *sqe;
+
+    tail = *r->sq_tail;
+    while (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >=
+           r->sq_entries)
+        ring_enter(r, 0);
+
+    idx = tail & *r->sq_mask;
+    sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = (uint64_t)(uintptr_t)c | op;
+    r->sq_array[idx] = idx;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    r->pending++;
+    return sqe;
+}
+
+/*********************
+ * Operation helpers
+ *********************/
+
+static void submit_accept(ring_t *r)
+{
+    struct io_uring_sqe *sqe = ring_sqe(r, NULL, OP_ACCEPT);
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = r->listenfd;
+    sqe->ioprio = r->oneshot ? 0 : IORING_ACCEPT_MULTISHOT;
+}
+
+/* Accept again after ACCEPT_BACKOFF_US, without stalling the ring */
+static void submit_backoff(ring_t *r)
+{
+    struct io_uring_sqe *sqe = ring_sqe(r, NULL, OP_BACKOFF);
+
+    r->backoff.tv_sec = 0;
+    r->backoff.tv_nsec = ACCEPT_BACKOFF_US * 1000L;
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t)(uintptr_t)&r->backoff;
+    sqe->len = 1;
+}
+
+static void submit_wake(ring_t *r)
+{
+    struct io_uring_sqe *sqe = ring_sqe(r, NULL, OP_WAKE);
+
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = r->efd;
+    sqe->addr = (uintptr_t)&r->wakeval;
+    sqe->len = sizeof(r->wakeval);
+}
+
+static void submit_send(uconn_t *c, int op, int fd, void *buf, size_t len)
+{
+    struct io_uring_sqe *sqe = ring_sqe(c->r, c, op);
+
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)buf;
+    sqe->len = len;
+    sqe->msg_flags = MSG_NOSIGNAL;
+}
+
+static void submit_recv(uconn_t *c)
+{
+    struct io_uring_sqe *sqe = ring_sqe(c->r, c, OP_RECV);
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = c->fd;
+    sqe->addr = (uintptr_t)(c->in + c->inlen);
+    sqe->len = sizeof(c->in) - c->inlen;
+}
+
+/* Read the next chunk of the response into the relay buffer */
+static void submit_read(uconn_t *c)
+{
+    struct io_uring_sqe *sqe;
+
+    twheel_arm(&c->r->wheel, &c->deadline, c->sfd, SHUT_RDWR,
+               deadline_budget(c->start_us, timeouts.idle_us));
+    sqe = ring_sqe(c->r, c, OP_READ);
+
+    sqe->opcode = c->bidx >= 0 ? IORING_OP_READ_FIXED : IORING_OP_RECV;
+    sqe->fd = c->sfd;
+    sqe->addr = (uintptr_t)c->buf;
+    sqe->len = UR_BUFSIZE;
+    sqe->buf_index = c->bidx >= 0 ? c->bidx : 0;
+}
+
+/* Send the rest of the reply or of the current relay chunk */
+static void submit_write(uconn_t *c)
+{
+    struct io_uring_sqe *sqe;
+
+    if (c->out || c->bidx < 0)
+    {
+        if (c->out)
+            submit_send(c, OP_WRITE, c->fd, c->out + c->outoff,
+                        c->outlen - c->outoff);
+        else
+            submit_send(c, OP_WRITE, c->fd, c->buf + c->bufoff,
+                        c->buflen - c->bufoff);
+        return;
+    }
+
+    /* The proxy ignores SIGPIPE, so a plain write is safe */
+    sqe = ring_sqe(c->r, c, OP_WRITE);
+    sqe->opcode = IORING_OP_WRITE_FIXED;
+    sqe->fd = c->fd;
+    sqe->addr = (uintptr_t)(c->buf + c->bufoff);
+    sqe->len = c->buflen - c->bufoff;
+    sqe->buf_index = c->bidx;
+}
+
+/*********************
+ * Connection states
+ *********************/
+
+static void conn_close(uconn_t *c)
+{
+    ring_t *r = c->r;
+
+    twheel_cancel(&r->wheel, &c->deadline);
+    close(c->fd);
+    if (c->sfd >= 0)
+        close(c->sfd);
+    if (c->ai)
+        freeaddrinfo(c->ai);
+    if (c->bidx >= 0)
+        r->freebufs[r->nfree++] = c->bidx;
+    else
+        free(c->buf);
+    free(c->out);
+    objbuf_free(&c->obj);
+    Free(c);
+}
+
+/* Send a reply produced by the proxy itself, then close */
+static void respond(uconn_t *c, char *resp, size_t len)
+{
+    /*
+     * A client that stops reading is dropped after the idle time, and one
+     * that reads slowly once the request is out of time
+     */
+    twheel_arm(&c->r->wheel, &c->deadline, c->fd, SHUT_RDWR,
+               deadline_budget(c->start_us, timeouts.idle_us));
+    free(c->out);
+    c->out = resp;
+    c->outlen = len;
+    c->outoff = 0;
+    submit_write(c);
+}
+
+static void send_error(uconn_t *c, const char *errnum, const char *shortmsg,
+                       const char *longmsg)
+{
+    size_t len;
+    char *resp = error_response(errnum, shortmsg, longmsg, &len);
+
+    respond(c, resp, len);
+}
+
+/*
+ * Offload task: look the request up in the cache and, if it must be
+ * fetched, resolve the end server; then wake the owning ring. Both can
+ * block, the cache on its locks and a compressed hit on decompression.
+ */
+static void request_task(task_t *tp)
+{
+    uconn_t *c = (uconn_t *)tp;
+    ring_t *r = c->r;
+    struct addrinfo hints;
+    uint64_t one = 1;
+
+    c->action = prepare_request(c->in, &c->hreq, c->uri, c->host, c->port,
+                                c->req, sizeof(c->req), &c->resp,
+                                &c->resplen);
+    if (c->action == REQ_FETCH)
+    {
+        c->start = now_us();
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+        c->gai_rc = getaddrinfo(c->host, c->port, &hints, &c->ai);
+    }
+
+    P(&r->mutex);
+    c->next = r->done;
+    r->done = c;
+    V(&r->mutex);
+    if (write(r->efd, &one, sizeof(one)) < 0)
+        perror("request_task: eventfd write");
+}
+
+/* Request bytes arrived from the client */
+static void on_recv(uconn_t *c, int res)
+{
+    int rc;
+
+    if (res <= 0)
+    {
+        if (c->deadline.expired)
+            send_error(c, "408", "Request Timeout",
+                       "Proxy timed out waiting for the request");
+        else
+            conn_close(c);
+        return;
+    }
+    c->inlen += res;
+    rc = http_parse(&c->hreq, c->in, c->inlen);
+    if (rc == HTTP_BAD)
+    {
+        send_error(c, "400", "Bad Request",
+                   "Proxy could not parse the request");
+        return;
+    }
+    if (rc == HTTP_TOOBIG || (rc == HTTP_MORE && c->inlen == sizeof(c->in)))
+    {
+        send_error(c, "431", "Request Header Fields Too Large",
+                   "Request header too large");
+        return;
+    }
+    if (rc == HTTP_MORE)
+    {
+        submit_recv(c);
+        return;
+    }
+
+    /* The lookups block, so they run on the offload pool */
+    twheel_cancel(&c->r->wheel, &c->deadline);
+    c->task.run = request_task;
+    offload_submit(&c->task);
+}
+
+/* Connect to the next candidate address */
+static void start_connect(uconn_t *c)
+{
+    struct io_uring_sqe *sqe;
+
+    for (; c->aip; c->aip = c->aip->ai_next)
+    {
+        struct addrinfo *p = c->aip;
+        long budget;
+
+        if ((c->sfd = socket(p->ai_family, p->ai_socktype,
+                             p->ai_protocol)) < 0)
+            continue;
+
+        /* Fall back to the next address after a stagger (RFC 8305) */
+        budget = deadline_budget(c->start_us, timeouts.connect_us);
+        if (p->ai_next && budget > CONNECT_STAGGER_MS * 1000L)
+            budget = CONNECT_STAGGER_MS * 1000L;
+        twheel_arm(&c->r->wheel, &c->deadline, c->sfd, SHUT_RDWR, budget);
+        sqe = ring_sqe(c->r, c, OP_CONNECT);
+        sqe->opcode = IORING_OP_CONNECT;
+        sqe->fd = c->sfd;
+        sqe->addr = (uintptr_t)p->ai_addr;
+        sqe->off = p->ai_addrlen;
+        return;
+    }
+
+    send_error(c, "502", "Bad Gateway",
+               "Proxy could not connect to end server");
+}
+
+static void on_connect(uconn_t *c, int res)
+{
+    ring_t *r = c->r;
+
+    if (res < 0 && c->deadline.expired && !c->aip->ai_next)
+    {
+        send_error(c, "504", "Gateway Timeout",
+                   "End server did not accept the connection in time");
+        return;
+    }
+    if (res < 0)
+    {
+        close(c->sfd);
+        c->sfd = -1;
+        c->aip = c->aip->ai_next;
+        start_connect(c);
+        return;
+    }
+    twheel_cancel(&r->wheel, &c->deadline);
+
+    /* Take a registered relay buffer if one is free */
+    if (r->nfree > 0)
+    {
+        c->bidx = r->freebufs[--r->nfree];
+        c->buf = r->bufs + c->bidx * UR_BUFSIZE;
+    }
+    else
+        c->buf = Malloc(UR_BUFSIZE);
+    objbuf_init(&c->obj);
+    submit_send(c, OP_SENDREQ, c->sfd, c->req, c->reqlen);
+}
+
+static void on_sendreq(uconn_t *c, int res)
+{
+    if (res < 0)
+    {
+        send_error(c, "502", "Bad Gateway",
+                   "Proxy could not send request to end server");
+        return;
+    }
+    c->reqoff += res;
+    if (c->reqoff < c->reqlen)
+        submit_send(c, OP_SENDREQ, c->sfd, c->req + c->reqoff,
+                    c->reqlen - c->reqoff);
+    else
+        submit_read(c);
+}
+
+/* A chunk of the response arrived, or the end server finished */
+static void on_read(uconn_t *c, int res)
+{
+    char *obj;
+    int size;
+
+    twheel_cancel(&c->r->wheel, &c->deadline);
+    if (res <= 0 && c->deadline.expired)
+    {
+        /* Truncated: never cache it, and say why if nothing was sent */
+        if (c->relayed == 0)
+            send_error(c, "504", "Gateway Timeout",
+                       "End server did not respond in time");
+        else
+            conn_close(c);
+        return;
+    }
+    if (res <= 0)
+    {
+        if (res == 0 && (obj = objbuf_take(&c->obj, &size)))
+            offload_write_cache(c->uri, obj, size, now_us() - c->start);
+        hotkey_update(&hotkeys, c->uri, c->relayed);
+        conn_close(c);
+        return;
+    }
+
+    objbuf_add(&c->obj, c->buf, res);
+    c->buflen = res;
+    c->bufoff = 0;
+    c->relayed += res;
+    /* Draining slowly does not stretch the total deadline either */
+    twheel_arm(&c->r->wheel, &c->deadline, c->fd, SHUT_RDWR,
+               deadline_budget(c->start_us, timeouts.idle_us));
+    submit_write(c);
+}
+
+/* Bytes went out to the client */
+static void on_write(uconn_t *c, int res)
+{
+    if (res < 0)
+    {
+        conn_close(c);
+        return;
+    }
+
+    if (c->out)
+    {
+        c->outoff += res;
+        if (c->outoff < c->outlen)
+            submit_write(c);
+        else
+            conn_close(c);
+        return;
+    }
+
+    c->bufoff += res;
+    if (c->bufoff < c->buflen)
+        submit_write(c);
+    else
+        submit_read(c);
+}
+
+/* A new client connection was accepted, or accept failed with -res */
+static void on_accept(ring_t *r, int res, unsigned flags)
+{
+    int one = 1;
+
+    if (res < 0)
+    {
+        if (flags & IORING_CQE_F_MORE)
+            return; /* Still armed */
+        if (res == -EINVAL && !r->oneshot)
+            r->oneshot = 1; /* Kernel predates multishot accept */
+        else if (res != -EINTR && res != -ECONNABORTED && res != -EPROTO)
+        {
+            /* E.g. out of descriptors: re-arming now would fail again */
+            fprintf(stderr, "accept: %s\n", strerror(-res));
+            submit_backoff(r);
+            return;
+        }
+        submit_accept(r);
+        return;
+    }
+    if (r->oneshot || !(flags & IORING_CQE_F_MORE))
+        submit_accept(r); /* Single accept or multishot ended: re-arm */
+    /* As in the epoll engine, relayed bytes must not wait on Nagle */
+    setsockopt(res, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    uconn_t *c = Calloc(1, sizeof(uconn_t));
+    c->r = r;
+    c->fd = res;
+    c->sfd = -1;
+    c->bidx = -1;
+    c->start_us = now_us();
+    twtimer_init(&c->deadline);
+    http_init(&c->hreq);
+    twheel_arm(&r->wheel, &c->deadline, c->fd, SHUT_RD, timeouts.header_us);
+    submit_recv(c);
+}
+
+/* Pick up connections whose lookups completed */
+static void on_wake(ring_t *r)
+{
+    uconn_t *c, *next;
+
+    P(&r->mutex);
+    c = r->done;
+    r->done = NULL;
+    V(&r->mutex);
+
+    for (; c; c = next)
+    {
+        next = c->next;
+        if (c->action == REQ_RESPOND)
+        {
+            char *resp = c->resp;
+
+            c->resp = NULL;
+            respond(c, resp, c->resplen);
+            continue;
+        }
+        c->reqlen = strlen(c->req);
+        if (c->gai_rc != 0)
+        {
+            c->ai = NULL;
+            send_error(c, "502", "Bad Gateway",
+                       "Proxy could not resolve end server");
+            continue;
+        }
+        c->aip = c->ai;
+        start_connect(c);
+    }
+    submit_wake(r);
+}
+
+static void *ring_thread(void *vargp)
+{
+    ring_t *r = vargp;
+
+    submit_accept(r);
+    submit_wake(r);
+
+    while (1)
+    {
+        unsigned head, tail;
+
+        ring_enter(r, 1);
+
+        head = *r->cq_head;
+        tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail)
+        {
+            struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+            uint64_t ud = cqe->user_data;
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+            uconn_t *c = (uconn_t *)(uintptr_t)(ud & ~(uint64_t)OP_MASK);
+
+            head++;
+            __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+
+            switch (ud & OP_MASK)
+            {
+            case OP_ACCEPT:
+                on_accept(r, res, flags);
+                break;
+            case OP_WAKE:
+                on_wake(r);
+                break;
+            case OP_RECV:
+                on_recv(c, res);
+                break;
+            case OP_CONNECT:
+                on_connect(c, res);
+                break;
+            case OP_SENDREQ:
+                on_sendreq(c, res);
+                break;
+            case OP_READ:
+                on_read(c, res);
+                break;
+            case OP_WRITE:
+                on_write(c, res);
+                break;
+            case OP_BACKOFF:
+                submit_accept(r);
+                break;
+            }
+        }
+    }
+    return NULL;
+}
+
+/* Create a ring that accepts from listenfd */
+static ring_t *ring_new(int listenfd)
+{
+    ring_t *r = Calloc(1, sizeof(ring_t));
+
+    ring_setup(r);
+    ring_register_buffers(r);
+    r->listenfd = listenfd;
+    if ((r->efd = eventfd(0, 0)) < 0)
+        unix_error("eventfd error");
+    Sem_init(&r->mutex, 0, 1);
+    twheel_init(&r->wheel, TIMEOUT_TICK_US);
+    return r;
+}
+
+/*
+ * uring_init - set up state shared by all rings. Call once before
+ *     uring_serve.
+ */
+void uring_init(void)
+{
+    offload_init(UR_OFFLOAD_THREADS);
+}
+
+/* uring_serve - run one ring on listenfd in this thread. Does not return. */
+void uring_serve(int listenfd)
+{
+    ring_thread(ring_new(listenfd));
+}
+
+/*
+ * uring_run - serve listenfd with nrings io_uring instances, each on
+ *     its own thread (one per online CPU if nrings <= 0). Does not return.
+ */
+void uring_run(int listenfd, int nrings)
+{
+    pthread_t tid;
+
+    if (nrings <= 0)
+        nrings = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nrings <= 0)
+        nrings = 1;
+
+    uring_init();
+    for (int i = 1; i < nrings; i++)
+        Pthread_create(&tid, NULL, ring_thread, ring_new(listenfd));
+    uring_serve(listenfd);
+}
@@ -0,0 +1,6 @@
+/*
+ * uring.h - io_uring connection engine
+ */
+void uring_run(int listenfd, int nrings);
+void uring_init(void);
+void uring_serve(int listenfd);
@@ -0,0 +1,309 @@
+/*
+ * wpool.c - adaptive work-stealing worker pool
+ *
+ * Every worker owns a bounded queue (an mpmc ring). Submissions from
+ * outside the pool are spread round-robin over the workers' queues;
+ * submissions from a worker (continuations of the task it is running)
+ * go to its own queue, so they run on the core whose cache already
+ * holds their data. A worker whose queue is empty steals from the
+ * others, starting at a random victim, so a burst queued behind one
+ * slow task is picked up by whoever is free. Idle workers sleep on one
+ * pool-wide futex that submitters only touch when someone is asleep.
+ *
+ * The pool runs between min and max workers. A submit starts another
+ * worker when nobody is idle and either more tasks are queued than
+ * there are workers or no task has been started for WPOOL_GROW_WAIT_US
+ * (every worker is stuck, e.g. on slow origins); a monitor thread
+ * applies the same test when no submits arrive. A worker that has been
+ * idle for WPOOL_IDLE_US retires while more than min remain.
+ */
+#include "csapp.h"
+#include "mpmc.h"
+#include "wpool.h"
+
+#define WPOOL_GROW_WAIT_US 50000L  /* Queued this long with no progress */
+#define WPOOL_IDLE_US 10000000L    /* Idle this long to retire */
+
+static __thread wpool_worker_t *self; /* Worker running on this thread */
+
+static void *wpool_thread(void *vargp);
+static int wpool_starved(wpool_t *p);
+
+static long wpool_now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+/* Start a worker on a free slot, unless the pool is at max */
+static void wpool_grow(wpool_t *p)
+{
+    pthread_t tid;
+
+    P(&p->mutex);
+    for (int i = 0; i < p->max && p->nactive < p->max; i++)
+    {
+        wpool_worker_t *w = &p->workers[i];
+
+        if (w->active)
+            continue;
+        __atomic_store_n(&w->active, 1, __ATOMIC_RELEASE);
+        p->nactive++;
+        p->grown++;
+        __atomic_fetch_add(&p->starting, 1, __ATOMIC_SEQ_CST);
+        Pthread_create(&tid, NULL, wpool_thread, w);
+        break;
+    }
+    V(&p->mutex);
+}
+
+/* Retire w if more than min workers remain; returns 1 if retired */
+static int wpool_retire(wpool_worker_t *w)
+{
+    wpool_t *p = w->pool;
+    int retired = 0;
+
+    P(&p->mutex);
+    if (p->nactive > p->min)
+    {
+        /* Anything still queued here will be stolen by the others */
+        __atomic_store_n(&w->active, 0, __ATOMIC_RELEASE);
+        p->nactive--;
+        p->retired++;
+        retired = 1;
+    }
+    V(&p->mutex);
+    return retired;
+}
+
+/* Take a task from w's own queue, or steal one from any other slot */
+static int wpool_find(wpool_worker_t *w, int *item)
+{
+    wpool_t *p = w->pool;
+    int start;
+
+    if (!mpmc_tryremove(&w->queue, item))
+    {
+        int i;
+
+        start = rand_r(&w->seed) % p->max;
+        for (i = 0; i < p->max; i++)
+        {
+            wpool_worker_t *victim = &p->workers[(start + i) % p->max];
+
+            if (victim != w && mpmc_tryremove(&victim->queue, item))
+                break;
+        }
+        if (i == p->max)
+            return 0;
+    }
+
+    __atomic_fetch_sub(&p->queued, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&p->last_take_us, wpool_now_us(), __ATOMIC_RELAXED);
+    return 1;
+}
+
+static void *wpool_thread(void *vargp)
+{
+    wpool_worker_t *w = vargp;
+    wpool_t *p = w->pool;
+    int item;
+
+    Pthread_detach(pthread_self());
+    self = w;
+    __atomic_fetch_sub(&p->starting, 1, __ATOMIC_SEQ_CST);
+    while (1)
+    {
+        unsigned seen;
+        int rc;
+
+        if (wpool_find(w, &item))
+        {
+            p->handler(item, p->arg);
+            continue;
+        }
+
+        /* Nothing anywhere: sleep until the next submit */
+        seen = __atomic_load_n(&p->idle_ev, __ATOMIC_SEQ_CST);
+        __atomic_fetch_add(&p->sleepers, 1, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (wpool_find(w, &item))
+        {
+            __atomic_fetch_sub(&p->sleepers, 1, __ATOMIC_SEQ_CST);
+            p->handler(item, p->arg);
+            continue;
+        }
+        rc = futex_timedwait(&p->idle_ev, seen, WPOOL_IDLE_US);
+        __atomic_fetch_sub(&p->sleepers, 1, __ATOMIC_SEQ_CST);
+        if (rc < 0 && errno == ETIMEDOUT && wpool_retire(w))
+            return NULL;
+    }
+    return NULL;
+}
+
+/* Grow the pool while queued tasks are not being started */
+static void *wpool_monitor(void *vargp)
+{
+    wpool_t *p = vargp;
+
+    Pthread_detach(pthread_self());
+    while (1)
+    {
+        usleep(WPOOL_GROW_WAIT_US);
+        while (wpool_starved(p))
+            wpool_grow(p);
+    }
+    return NULL;
+}
+
+/*
+ * wpool_init - start min workers (growing up to max), each with a
+ *     qsize-slot queue, that run handler(item, arg) on every submitted
+ *     item.
+ */
+void wpool_init(wpool_t *p, int min, int max, int qsize,
+                void (*handler)(int, void *), void *arg)
+{
+    pthread_t tid;
+
+    if (min < 1)
+        min = 1;
+    if (max < min)
+        max = min;
+
+    memset(p, 0, sizeof(*p));
+    p->min = min;
+    p->max = max;
+    p->handler = handler;
+    p->arg = arg;
+    p->last_take_us = wpool_now_us();
+    Sem_init(&p->mutex, 0, 1);
+    if (posix_memalign((void **)&p->workers, MPMC_CACHE_LINE,
+                       max * sizeof(wpool_worker_t)) != 0)
+        app_error("posix_memalign error");
+    memset(p->workers, 0, max * sizeof(wpool_worker_t));
+
+    for (int i = 0; i < max; i++)
+    {
+        wpool_worker_t *w = &p->workers[i];
+
+        mpmc_init(&w->queue, qsize);
+        w->pool = p;
+        w->seed = i * 2654435761u + 1;
+    }
+    for (int i = 0; i < min; i++)
+        wpool_grow(p);
+    if (max > min)
+        Pthread_create(&tid, NULL, wpool_monitor, p);
+}
+
+/* Should another worker be started to take queued work? */
+static int wpool_starved(wpool_t *p)
+{
+    int queued = __atomic_load_n(&p->queued, __ATOMIC_RELAXED);
+    long idle_for;
+
+    /* Idle or just-started workers will pick the work up */
+    if (p->nactive >= p->max || queued <= 0 ||
+        __atomic_load_n(&p->sleepers, __ATOMIC_SEQ_CST) > 0 ||
+        __atomic_load_n(&p->starting, __ATOMIC_SEQ_CST) > 0)
+        return 0;
+    if (queued > p->nactive)
+        return 1;
+    idle_for = wpool_now_us() -
+               __atomic_load_n(&p->last_take_us, __ATOMIC_RELAXED);
+    return idle_for > WPOOL_GROW_WAIT_US;
+}
+
+/*
+ * wpool_push - queue item. A worker of p queues to itself; anyone else
+ *     queues round-robin over live workers. If every queue is full the
+ *     pool grows and we wait for room, unless it is at max and block
+ *     is 0, in which case the item is refused and 0 returned.
+ */
+static int wpool_push(wpool_t *p, int item, int block)
+{
+    wpool_worker_t *w = self;
+    int k;
+
+    if (!w || w->pool != p)
+    {
+        unsigned i = __atomic_fetch_add(&p->next, 1, __ATOMIC_RELAXED);
+
+        w = &p->workers[i % p->max];
+        for (k = 0; k < p->max && !__atomic_load_n(&w->active,
+                                                   __ATOMIC_ACQUIRE);
+             k++)
+            w = &p->workers[(i + k + 1) % p->max];
+    }
+
+    __atomic_fetch_add(&p->queued, 1, __ATOMIC_RELAXED);
+    if (!mpmc_tryinsert(&w->queue, item))
+    {
+        /* Full: any other queue with room will do before waiting */
+        for (k = 1; k < p->max; k++)
+        {
+            wpool_worker_t *o = &p->workers[(w - p->workers + k) % p->max];
+            if (mpmc_tryinsert(&o->queue, item))
+                break;
+        }
+        if (k == p->max)
+        {
+            if (!block && p->nactive >= p->max)
+            {
+                __atomic_fetch_sub(&p->queued, 1, __ATOMIC_RELAXED);
+                __atomic_fetch_add(&p->refused, 1, __ATOMIC_RELAXED);
+                return 0;
+            }
+            /* A new worker will steal from this queue shortly */
+            wpool_grow(p);
+            mpmc_insert(&w->queue, item);
+        }
+    }
+
+    /* Wake a sleeper so it can take or steal the task */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&p->sleepers, __ATOMIC_SEQ_CST) > 0)
+    {
+        __atomic_fetch_add(&p->idle_ev, 1, __ATOMIC_SEQ_CST);
+        futex_wake(&p->idle_ev);
+    }
+    else if (wpool_starved(p))
+        wpool_grow(p);
+    return 1;
+}
+
+/* wpool_submit - queue item, waiting for room if the pool is saturated */
+void wpool_submit(wpool_t *p, int item)
+{
+    wpool_push(p, item, 1);
+}
+
+/*
+ * wpool_trysubmit - queue item unless every queue is full and the pool
+ *     is already at max; returns 0 if the item was refused.
+ */
+int wpool_trysubmit(wpool_t *p, int item)
+{
+    return wpool_push(p, item, 0);
+}
+
+/* Format the pool's size and queue depth; returns bytes written */
+int wpool_report(wpool_t *p, char *buf, size_t bufsz)
+{
+    int n;
+
+    P(&p->mutex);
+    n = snprintf(buf, bufsz,
+                 "pool: %d workers (min %d, max %d), %d idle, %d queued, "
+                 "%ld started, %ld retired, %ld refused\n",
+                 p->nactive, p->min, p->max,
+                 __atomic_load_n(&p->sleepers, __ATOMIC_RELAXED),
+                 __atomic_load_n(&p->queued, __ATOMIC_RELAXED),
+                 p->grown, p->retired,
+                 __atomic_load_n(&p->refused, __ATOMIC_RELAXED));
+    V(&p->mutex);
+    return n < (int)bufsz ? n : (int)bufsz - 1;
+}
@@ -0,0 +1,35 @@
+/*
+ * wpool.h - adaptive work-stealing worker pool
+ */
+typedef struct
+{
+    mpmc_t queue;            /* This worker's tasks (must be first) */
+    struct wpool *pool;      /* Owning pool */
+    unsigned seed;           /* State for picking steal victims */
+    int active;              /* A thread is serving this queue */
+} wpool_worker_t;
+
+typedef struct wpool
+{
+    wpool_worker_t *workers; /* One slot per potential worker */
+    int min, max;            /* Bounds on the number of workers */
+    int nactive;             /* Live workers */
+    int starting;            /* Workers created but not yet running */
+    void (*handler)(int item, void *arg); /* Runs each task */
+    void *arg;               /* Passed to every handler call */
+    unsigned next;           /* Round-robin cursor for outside submits */
+    int queued;              /* Tasks waiting in all queues */
+    long last_take_us;       /* When a worker last started a task */
+    long grown, retired;     /* Workers started and retired so far */
+    long refused;            /* Items turned away by wpool_trysubmit */
+    sem_t mutex;             /* Serializes growing and retiring */
+    /* Futex word and sleeper count for idle workers */
+    unsigned idle_ev __attribute__((aligned(MPMC_CACHE_LINE)));
+    int sleepers;
+} wpool_t;
+
+void wpool_init(wpool_t *p, int min, int max, int qsize,
+                void (*handler)(int, void *), void *arg);
+void wpool_submit(wpool_t *p, int item);
+int wpool_trysubmit(wpool_t *p, int item);
+int wpool_report(wpool_t *p, char *buf, size_t bufsz);